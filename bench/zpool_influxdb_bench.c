@@ -0,0 +1,363 @@
+/*
+ * Benchmark the vdev printers on synthetic pools, so the cost of a change
+ * can be measured without a live pool
+ * usage: zpool_influxdb_bench [options]
+ * where options are:
+ *   --iterations, -i count  samples to time for each case (default 100)
+ *   --leaves, -l n[,n..]   leaf counts to try (default 1,10,100,1000,2000)
+ *   --layout, -L name      mirror, raidz or draid (default all three)
+ *   --rates, -r            as for zpool_influxdb
+ *   --sum-histogram-buckets, -s  as for zpool_influxdb
+ *
+ * The pools are built with the nvpair API in the same shape as a
+ * zpool_get_config() vdev tree, with every vdev's stats and stats_ex
+ * histograms filled in:
+ *   mirror  2-way mirrors, a single disk for 1 leaf
+ *   raidz   raidz2 groups of up to 10 disks
+ *   draid   draid2 groups of up to 100 disks
+ *
+ * For each pool, each vdev printer is timed on its own and then all of
+ * them together, as in a default sample. The output is formatted but
+ * discarded. The counters don't change between samples, so the rates are
+ * all zero and --histogram-deltas would leave out every bucket.
+ *
+ * Build and run with `make bench`.
+ */
+
+#define main zpool_influxdb_main
+#include "../zpool_influxdb.c"
+#undef main
+
+#define BENCH_POOL  "bench"
+
+typedef struct bench_layout {
+    const char *name;
+    const char *type;           /* the type of the top-level vdevs */
+    uint_t width;               /* leaves per top-level vdev */
+    uint64_t nparity;
+} bench_layout_t;
+
+bench_layout_t bench_layouts[] = {
+    {"mirror", VDEV_TYPE_MIRROR, 2, 0},
+    {"raidz", VDEV_TYPE_RAIDZ, 10, 2},
+    {"draid", "draid", 100, 2},
+    {NULL, NULL, 0, 0}
+};
+
+/* the stats_ex histograms the printers look up, and their bucket counts */
+struct bench_histo {
+    const char *name;
+    uint_t buckets;
+} bench_histos[] = {
+    {ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO,   VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO,   VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO,  VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO,  VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,  VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,  VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO, VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO, VDEV_L_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_SCRUB_LAT_HISTO,   VDEV_L_HISTO_BUCKETS},
+#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
+    {ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO,    VDEV_L_HISTO_BUCKETS},
+#endif
+    {ZPOOL_CONFIG_VDEV_SYNC_IND_R_HISTO,  VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_SYNC_IND_W_HISTO,  VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_ASYNC_IND_R_HISTO, VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_ASYNC_IND_W_HISTO, VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_IND_SCRUB_HISTO,   VDEV_RQ_HISTO_BUCKETS},
+#ifdef ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO
+    {ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO,    VDEV_RQ_HISTO_BUCKETS},
+#endif
+    {ZPOOL_CONFIG_VDEV_SYNC_AGG_R_HISTO,  VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_SYNC_AGG_W_HISTO,  VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_ASYNC_AGG_R_HISTO, VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_ASYNC_AGG_W_HISTO, VDEV_RQ_HISTO_BUCKETS},
+    {ZPOOL_CONFIG_VDEV_AGG_SCRUB_HISTO,   VDEV_RQ_HISTO_BUCKETS},
+#ifdef ZPOOL_CONFIG_VDEV_AGG_TRIM_HISTO
+    {ZPOOL_CONFIG_VDEV_AGG_TRIM_HISTO,    VDEV_RQ_HISTO_BUCKETS},
+#endif
+    {NULL, 0}
+};
+
+const char *bench_queues[] = {
+    ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,
+    ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,
+    ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE,
+    ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE,
+    ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,
+    ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,
+    ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,
+    ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,
+    ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,
+    ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,
+    NULL
+};
+
+uint64_t bench_txg = 0;
+uint64_t bench_seed = 88172645463325252ULL;
+
+/* xorshift, so every run builds the same pools */
+uint64_t
+bench_random(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return (bench_seed);
+}
+
+nvlist_t *
+bench_nvlist(void) {
+    nvlist_t *nvl;
+
+    if (nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0) != 0) {
+        fprintf(stderr, "error: cannot allocate memory\n");
+        exit(1);
+    }
+    return (nvl);
+}
+
+/*
+ * a vdev with its stats, the histograms are filled in from 1us to 1s and
+ * 512 bytes to 16MiB, where real pools have most of their I/Os
+ */
+nvlist_t *
+bench_vdev(const char *type, uint64_t id, const char *path) {
+    nvlist_t *nv = bench_nvlist();
+    nvlist_t *nv_ex = bench_nvlist();
+    uint64_t histo[MAX_HISTO_BUCKETS];
+    vdev_stat_t vs;
+
+    (void) nvlist_add_string(nv, ZPOOL_CONFIG_TYPE, type);
+    (void) nvlist_add_uint64(nv, ZPOOL_CONFIG_ID, id);
+    (void) nvlist_add_uint64(nv, ZPOOL_CONFIG_GUID, bench_random() | 1);
+    if (path != NULL)
+        (void) nvlist_add_string(nv, ZPOOL_CONFIG_PATH, path);
+
+    (void) memset(&vs, 0, sizeof (vs));
+    vs.vs_state = VDEV_STATE_HEALTHY;
+    vs.vs_space = 1ULL << 42;
+    vs.vs_alloc = bench_random() % vs.vs_space;
+    vs.vs_ops[ZIO_TYPE_READ] = bench_random() % 1000000000;
+    vs.vs_ops[ZIO_TYPE_WRITE] = bench_random() % 1000000000;
+    vs.vs_bytes[ZIO_TYPE_READ] = vs.vs_ops[ZIO_TYPE_READ] * 8192;
+    vs.vs_bytes[ZIO_TYPE_WRITE] = vs.vs_ops[ZIO_TYPE_WRITE] * 8192;
+    vs.vs_fragmentation = bench_random() % 100;
+    (void) nvlist_add_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
+                                   (uint64_t *) &vs,
+                                   sizeof (vs) / sizeof (uint64_t));
+
+    for (int i = 0; bench_histos[i].name; i++) {
+        uint_t low = bench_histos[i].buckets == VDEV_L_HISTO_BUCKETS ?
+            10 : 9;
+        uint_t high = bench_histos[i].buckets == VDEV_L_HISTO_BUCKETS ?
+            30 : 24;
+
+        for (uint_t b = 0; b < bench_histos[i].buckets; b++) {
+            histo[b] = b >= low && b <= high ?
+                bench_random() % 10000000 : 0;
+        }
+        (void) nvlist_add_uint64_array(nv_ex, bench_histos[i].name, histo,
+                                       bench_histos[i].buckets);
+    }
+    for (int i = 0; bench_queues[i]; i++)
+        (void) nvlist_add_uint64(nv_ex, bench_queues[i], bench_random() % 32);
+    (void) nvlist_add_nvlist(nv, ZPOOL_CONFIG_VDEV_STATS_EX, nv_ex);
+    nvlist_free(nv_ex);
+    return (nv);
+}
+
+void
+bench_add_children(nvlist_t *nv, nvlist_t **child, uint_t children) {
+    (void) nvlist_add_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN, child,
+                                   children);
+    for (uint_t c = 0; c < children; c++)
+        nvlist_free(child[c]);
+}
+
+/*
+ * build a pool config with leaves disks
+ */
+nvlist_t *
+bench_pool(const bench_layout_t *layout, uint_t leaves) {
+    nvlist_t *config = bench_nvlist();
+    nvlist_t *root, **top, **disks;
+    uint_t ntop = (leaves + layout->width - 1) / layout->width;
+    uint_t leaf = 0, width;
+    char path[64];
+
+    top = safe_calloc(ntop, sizeof (nvlist_t *));
+    disks = safe_calloc(layout->width, sizeof (nvlist_t *));
+    for (uint_t t = 0; t < ntop; t++) {
+        width = leaves - leaf < layout->width ? leaves - leaf : layout->width;
+        if (width == 1) {
+            (void) snprintf(path, sizeof (path),
+                            "/dev/disk/by-id/bench-disk-%u", leaf++);
+            top[t] = bench_vdev(VDEV_TYPE_DISK, t, path);
+            continue;
+        }
+        top[t] = bench_vdev(layout->type, t, NULL);
+        if (layout->nparity != 0) {
+            (void) nvlist_add_uint64(top[t], ZPOOL_CONFIG_NPARITY,
+                                     layout->nparity);
+        }
+        for (uint_t d = 0; d < width; d++) {
+            (void) snprintf(path, sizeof (path),
+                            "/dev/disk/by-id/bench-disk-%u", leaf++);
+            disks[d] = bench_vdev(VDEV_TYPE_DISK, d, path);
+        }
+        bench_add_children(top[t], disks, width);
+    }
+
+    root = bench_vdev(VDEV_TYPE_ROOT, 0, NULL);
+    bench_add_children(root, top, ntop);
+    /* a new config txg, so the vdev cache starts over for each pool */
+    (void) nvlist_add_uint64(config, ZPOOL_CONFIG_POOL_TXG, ++bench_txg);
+    (void) nvlist_add_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, root);
+    nvlist_free(root);
+    free(top);
+    free(disks);
+    return (config);
+}
+
+/*
+ * time iterations samples of the pool with the printers in enabled
+ */
+void
+bench_run(const char *layout, uint_t leaves, nvlist_t *config,
+          const char *printer, uint_t enabled, uint_t iterations) {
+    lp_writer_t out;
+    pool_sample_t sample;
+    nvlist_t *nvroot;
+    uint64_t start = 0, elapsed, bytes;
+    uint_t vdevs = 0;
+
+    (void) nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &nvroot);
+    /* nothing is written, the buffer is just emptied as it fills */
+    lp_init(&out, NULL, NULL);
+    out.batch_max = LP_INITIAL_SIZE / 2;
+    sample.out = &out;
+    sample.timestamp = 1600000000000000000ULL;
+    sample.event = 0;
+
+    /* the first sample fills the vdev cache, as in execd mode */
+    for (uint_t i = 0; i <= iterations; i++) {
+        if (i == 1) {
+            out.lines = 0;
+            out.bytes = 0;
+            out.len = 0;
+            start = clock_ns(CLOCK_MONOTONIC);
+        }
+        sample.pc = pool_cache_get(BENCH_POOL, config);
+        sample.hrtime = clock_ns(CLOCK_MONOTONIC);
+        sample.vdevs = 0;
+        if (walk_vdev_tree(&sample, nvroot, NULL, 0, enabled, 0) != 0) {
+            fprintf(stderr, "error: %s printer failed\n", printer);
+            exit(1);
+        }
+        vdevs += i > 0 ? sample.vdevs : 0;
+    }
+    elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+    elapsed = elapsed ? elapsed : 1;
+    bytes = out.bytes + out.len;
+
+    printf("%-7s %6u %-10s %12.0f %12.0f %10.1f %10.1f\n",
+           layout, leaves, printer,
+           (double) out.lines * 1e9 / (double) elapsed,
+           (double) bytes * 1e9 / (double) elapsed / (1024 * 1024),
+           (double) elapsed / (double) (vdevs ? vdevs : 1),
+           (double) out.lines / (double) iterations);
+    free(out.buf);
+}
+
+void
+bench_usage(char *name) {
+    fprintf(stderr, "usage: %s [--iterations count][--leaves n[,n..]]"
+                    "[--layout mirror|raidz|draid][--rates]"
+                    "[--sum-histogram-buckets]"
+                    "\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[]) {
+    int opt;
+    char *end, *leaves_list = "1,10,100,1000,2000";
+    const char *layout_name = NULL;
+    uint_t iterations = 100, leaves, all = 0;
+    bench_layout_t *l;
+    long value;
+    nvlist_t *config;
+    struct option long_options[] = {
+        {"iterations", required_argument, NULL, 'i'},
+        {"layout", required_argument, NULL, 'L'},
+        {"leaves", required_argument, NULL, 'l'},
+        {"rates", no_argument, NULL, 'r'},
+        {"sum-histogram-buckets", no_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hi:L:l:rs", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                errno = 0;
+                value = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    value < 1 || value > 1000000)
+                    bench_usage(argv[0]);
+                iterations = (uint_t) value;
+                break;
+            case 'L':
+                layout_name = optarg;
+                break;
+            case 'l':
+                leaves_list = optarg;
+                break;
+            case 'r':
+                print_rates = 1;
+                break;
+            case 's':
+                sum_histogram_buckets = 1;
+                break;
+            default:
+                bench_usage(argv[0]);
+        }
+    }
+    for (l = bench_layouts; layout_name != NULL && l->name; l++) {
+        if (strcmp(layout_name, l->name) == 0)
+            break;
+    }
+    if (layout_name != NULL && l->name == NULL)
+        bench_usage(argv[0]);
+
+    stats_ex_init();
+    init_histogram_tags();
+    for (int i = 0; vdev_printers[i].func; i++)
+        all |= 1U << i;
+
+    printf("%-7s %6s %-10s %12s %12s %10s %10s\n", "layout", "leaves",
+           "printer", "lines/s", "MiB/s", "ns/vdev", "lines");
+    for (l = bench_layouts; l->name; l++) {
+        if (layout_name != NULL && strcmp(layout_name, l->name) != 0)
+            continue;
+        for (char *s = leaves_list; *s != '\0'; s = end + (*end == ',')) {
+            errno = 0;
+            value = strtol(s, &end, 10);
+            if (errno != 0 || end == s || (*end != ',' && *end != '\0') ||
+                value < 1 || value > 100000)
+                bench_usage(argv[0]);
+            leaves = (uint_t) value;
+
+            config = bench_pool(l, leaves);
+            for (int i = 0; vdev_printers[i].func; i++) {
+                bench_run(l->name, leaves, config, vdev_printers[i].name,
+                          1U << i, iterations);
+            }
+            bench_run(l->name, leaves, config, "all", all, iterations);
+            nvlist_free(config);
+        }
+    }
+    return (0);
+}
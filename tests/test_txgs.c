@@ -0,0 +1,108 @@
+/*
+ * Check that --txgs parses a txgs kstat as ZFS writes it, with the kstat
+ * header line before the column titles, and prints only the committed
+ * txgs it hasn't printed before
+ *
+ * Run with `make test` or ctest.
+ */
+
+#define main zpool_influxdb_main
+#include "../zpool_influxdb.c"
+#undef main
+
+/* from a Linux host, zfs_txg_history=5 */
+static const char txgs_sample[] =
+    "18 0 0x01 5 560 6378566894 2018967372707\n"
+    "txg      birth            state ndirty       nread        nwritten     "
+    "reads    writes   otime        qtime        wtime        stime\n"
+    "9705221  2010909598392    C     794624       0            3145728      "
+    "0        120      5000132355   5750         4751         34484597\n"
+    "9705222  2015909730747    C     1212416      0            4734976      "
+    "0        187      4999895740   5183         28268        40605527\n"
+    "9705223  2020909626487    C     577536       0            2256896      "
+    "0        85       4999983755   5265         11551        25310862\n"
+    "9705224  2025909610242    S     0            0            0            "
+    "0        0        4999872957   8795         0            0\n"
+    "9705225  2030909483199    O     0            0            0            "
+    "0        0        0            0            0            0\n";
+
+static int failed = 0;
+
+static void
+check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failed = 1;
+    }
+}
+
+static uint_t
+count_lines(const char *buf, size_t len) {
+    uint_t n = 0;
+
+    for (size_t i = 0; i < len; i++)
+        n += buf[i] == '\n';
+    return (n);
+}
+
+int
+main(void) {
+    char dir[] = "/tmp/zpool_influxdb_test.XXXXXX";
+    char path[PATH_MAX];
+    char expect[512];
+    pool_sample_t sample;
+    lp_writer_t out;
+    FILE *fp;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return (1);
+    }
+    (void) snprintf(path, sizeof (path), "%s/spl", dir);
+    (void) mkdir(path, 0755);
+    (void) snprintf(path, sizeof (path), "%s/spl/kstat", dir);
+    (void) mkdir(path, 0755);
+    (void) snprintf(path, sizeof (path), "%s/spl/kstat/zfs", dir);
+    (void) mkdir(path, 0755);
+    (void) snprintf(path, sizeof (path), "%s/spl/kstat/zfs/tank", dir);
+    (void) mkdir(path, 0755);
+    (void) snprintf(path, sizeof (path), "%s/spl/kstat/zfs/tank/txgs", dir);
+    if ((fp = fopen(path, "w")) == NULL) {
+        perror(path);
+        return (1);
+    }
+    (void) fputs(txgs_sample, fp);
+    (void) fclose(fp);
+    (void) setenv("HOST_PROC", dir, 1);
+
+    lp_init(&out, lp_sink_fd, &stdout_fd);
+    (void) memset(&sample, 0, sizeof (sample));
+    sample.pc = pool_cache_find("tank");
+    sample.out = &out;
+
+    check(print_txgs(&sample) == 0, "print_txgs succeeds");
+    lp_putc(&out, '\0');
+    out.len--;
+    check(count_lines(out.buf, out.len) == 3, "the 3 committed txgs");
+    (void) snprintf(expect, sizeof (expect), "zpool_txgs,name=tank "
+                    "txg=9705221%c,ndirty=794624%c,nread=0%c,"
+                    "nwritten=3145728%c,reads=0%c,writes=120%c,"
+                    "otime=5000132355%c,qtime=5750%c,wtime=4751%c,"
+                    "stime=34484597%c ", IFMT_SUFFIX, IFMT_SUFFIX,
+                    IFMT_SUFFIX, IFMT_SUFFIX, IFMT_SUFFIX, IFMT_SUFFIX,
+                    IFMT_SUFFIX, IFMT_SUFFIX, IFMT_SUFFIX, IFMT_SUFFIX);
+    check(strstr(out.buf, expect) != NULL, "the fields of txg 9705221");
+    check(strstr(out.buf, "txg=9705224") == NULL, "no syncing txg");
+    check(strstr(out.buf, "txg=9705225") == NULL, "no open txg");
+    check(sample.pc->last_txg == 9705223, "the last txg printed");
+
+    /* nothing new since */
+    out.len = 0;
+    check(print_txgs(&sample) == 0, "print_txgs succeeds again");
+    check(out.len == 0, "no txgs printed twice");
+
+    (void) unlink(path);
+    if (!failed)
+        printf("ok\n");
+    return (failed);
+}
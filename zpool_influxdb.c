@@ -9,10 +9,89 @@
  *   --no-histograms, -n   don't print histogram data (reduces cardinality
  *                         if you don't care about histograms)
  *   --sum-histogram-buckets, -s sum histogram bucket values
+ *   --batch-size, -b bytes  write output whenever this many bytes are
+ *                         buffered, rather than once per pool
+ *   --interval, -i seconds  run as a daemon, sampling on wall-clock
+ *                         aligned boundaries every interval
+ *   --threads, -t count   refresh pools in parallel on this many threads
+ *   --pool-timeout, -p seconds  sample each pool in its own process and
+ *                         give up on pools that take longer than this
+ *   --output, -o url      send to InfluxDB at http://host:port/write?db=..,
+ *                         http://host:port/api/v2/write?org=..&bucket=..
+ *                         or udp://host:port rather than stdout. For 2.x,
+ *                         the token is read from $INFLUX_TOKEN. Or send
+ *                         OTLP/HTTP to an OpenTelemetry collector at
+ *                         otlp://host:port
+ *   --flush-interval, -f seconds  with HTTP output, post at most this often
+ *   --gzip, -z            with HTTP output, compress the posts
+ *   --listen, -l [addr:]port  with --interval, serve the last sample at
+ *                         /metrics for Prometheus rather than printing it
+ *   --latency-summary, -L print latency quantiles and mean per vdev,
+ *                         for the I/Os since the last sample
+ *   --no-latency-buckets, -B  don't print the latency histogram buckets
+ *   --rates, -r           print per-second I/O and error rates per vdev,
+ *                         from the second sample on
+ *   --histogram-deltas, -d  print histogram increments since the last
+ *                         sample, leaving out the buckets that didn't change
+ *   --latency-range, -R min:max  only print the latency buckets from min to
+ *                         max, such as 8us:1ms, the rest are summed into
+ *                         the first bucket and +Inf
+ *   --size-range, -S min:max  likewise for the request size buckets, such
+ *                         as 4k:1m
+ *   --bucket-factor, -F n  merge buckets so each is n times the one before,
+ *                         n is a power of 2
+ *   --max-depth, -D depth  don't print vdevs below depth, 0 is the pool and
+ *                         1 the top-level vdevs
+ *   --top-leaves, -T n[:ops|:latency]  print all of the top-level vdevs
+ *                         but only the n leaves with the most ops, or the
+ *                         highest mean latency, since the last sample
+ *   --internal-stats, -I  print what each sample cost the collector in
+ *                         zpool_influxdb_internal
+ *   --arcstats, -a        also print the ARC and L2ARC stats, as telegraf's
+ *                         zfs input does
+ *   --txgs, -x            also print each pool's txgs as they are
+ *                         committed
+ *   --datasets, -O        also print each dataset's I/O from the pool's
+ *                         objset kstats
+ *   --record, -w file     also append each pool's config to file
+ *   --replay, -W file     print the samples recorded in file rather than
+ *                         sampling the pools
+ *   --paced, -P           with --replay, print the samples as far apart
+ *                         as they were recorded
+ *   --events, -E          with --interval, also print a pool's zpool_stats
+ *                         and zpool_scan_stats as soon as a ZFS event
+ *                         changes its config or state
+ *   --include, -g glob[,glob]  only sample the pools matching a glob, can
+ *                         be repeated
+ *   --exclude, -G glob[,glob]  don't sample the pools matching a glob, can
+ *                         be repeated
+ *   --select, -k measurement[:field[,field]]  only print the per-vdev
+ *                         measurements selected and, for the histograms
+ *                         and queues, only these fields, can be repeated,
+ *                         not with --rates, --latency-summary or
+ *                         --no-latency-buckets
+ *   --fields-file, -K file  read --select lines from file
+ *   --queue-sample, -Q hz  with --interval, sample the pools' queue depths
+ *                         hz times a second and print their min, max,
+ *                         mean and p99 per interval
+ *   --shm, -m file        also keep the last sample's vdev stats in file
+ *                         for other processes to mmap(), see
+ *                         zpool_influxdb_shm.h
+ *   --guid-tags, -u       tag the vdevs by GUID alone, and print their
+ *                         names and paths in zpool_vdev_info when the
+ *                         tree changes
+ *   --classes, -C         also print the stats and histograms summed per
+ *                         allocation class: normal, log, special, dedup,
+ *                         cache and spare
+ *   --ioctl, -X           read the pool configs from /dev/zfs with
+ *                         ZFS_IOC_POOL_STATS rather than through libzfs,
+ *                         needs sys/zfs_ioctl.h at build time
  *
  * To integrate into telegraf use one of:
  * 1. the `inputs.execd` plugin with the `--execd` option
- * 2. the `inputs.exec` plugin to simply run with no options
+ * 2. the `inputs.execd` plugin with the `--interval` option and
+ *    `signal = "none"`
+ * 3. the `inputs.exec` plugin to simply run with no options
  *
  * NOTE: libzfs is an unstable interface. YMMV.
  * For Linux compile with:
@@ -52,20 +131,62 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/fs/zfs.h>
 #include <libzfs.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZFS_IOCTL_H
+#include <sys/ioctl.h>
+#include <sys/zfs_ioctl.h>
+#endif
+#include "zpool_influxdb_shm.h"
 
 #define POOL_MEASUREMENT        "zpool_stats"
 #define SCAN_MEASUREMENT        "zpool_scan_stats"
 #define VDEV_MEASUREMENT        "zpool_vdev_stats"
 #define POOL_LATENCY_MEASUREMENT        "zpool_latency"
 #define POOL_QUEUE_MEASUREMENT  "zpool_vdev_queue"
+#define POOL_LATENCY_SUMMARY_MEASUREMENT    "zpool_latency_summary"
+#define POOL_RATES_MEASUREMENT  "zpool_rates"
+#define INTERNAL_MEASUREMENT    "zpool_influxdb_internal"
+#define ARC_MEASUREMENT         "zfs"   /* as for telegraf's zfs input */
+#define TXG_MEASUREMENT         "zpool_txgs"
+#define DATASET_MEASUREMENT     "zpool_dataset"
+#define QUEUE_DEPTH_MEASUREMENT "zpool_queue_depth"
+#define VDEV_INFO_MEASUREMENT   "zpool_vdev_info"
+#define CLASS_MEASUREMENT       "zpool_class_stats"
+#define CLASS_LATENCY_MEASUREMENT   "zpool_class_latency"
+#define CLASS_IO_SIZE_MEASUREMENT   "zpool_class_io_size"
+#define COLLECTOR_HEALTH_MEASUREMENT    "zpool_collector_health"
 #define MIN_LAT_INDEX        10  /* minimum latency index 10 = 1024ns */
+#define LAT_TYPES_MAX        10  /* latency histograms per vdev */
 #define POOL_IO_SIZE_MEASUREMENT        "zpool_io_size"
 #define MIN_SIZE_INDEX        9  /* minimum size index 9 = 512 bytes */
+#define SIZE_TYPES_MAX       12  /* size histograms per vdev */
 
 /*
  * telegraf 1.6.4 can handle uint64, which is the native ZFS type
@@ -80,9 +201,11 @@
  */
 #ifdef SUPPORT_UINT64
 #define IFMT "%luu"
+#define IFMT_SUFFIX 'u'
 #define MASK_UINT64(x) (x)
 #else
 #define IFMT "%lui"
+#define IFMT_SUFFIX 'i'
 #define MASK_UINT64(x) ((x) & INT64_MAX)
 #endif
 
@@ -90,8 +213,28 @@
 int execd_mode = 0;
 int no_histograms = 0;
 int sum_histogram_buckets = 0;
-uint64_t timestamp = 0;
+size_t batch_size = 0;
 int complained_about_sync = 0;
+uint64_t interval_ns = 0;
+uint64_t queue_sample_ns = 0;
+uint64_t sample_time = 0;       /* if set, the timestamp for all pools */
+int latency_summary = 0;
+int no_latency_buckets = 0;
+int print_rates = 0;
+int histogram_deltas = 0;
+int max_depth = -1;             /* -1 = the whole vdev tree */
+uint_t top_leaves = 0;          /* 0 = all of the leaves */
+int top_leaves_by = 0;          /* TOP_BY_OPS or TOP_BY_LATENCY */
+int internal_stats = 0;
+int arcstats = 0;
+int txg_history = 0;
+int dataset_stats = 0;
+char *shm_path = NULL;
+int guid_tags = 0;
+int class_stats = 0;
+
+#define TOP_BY_OPS      0
+#define TOP_BY_LATENCY  1
 
 /*
  * in cases where ZFS is installed, but not the ZFS dev environment, copy in
@@ -111,6 +254,36 @@ struct zpool_handle {
 };
 #endif
 
+void *
+safe_calloc(size_t nmemb, size_t size) {
+    void *p = calloc(nmemb, size);
+    if (p == NULL) {
+        fprintf(stderr, "error: cannot allocate memory\n");
+        exit(1);
+    }
+    return (p);
+}
+
+void *
+safe_realloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL) {
+        fprintf(stderr, "error: cannot allocate memory\n");
+        exit(1);
+    }
+    return (p);
+}
+
+char *
+safe_strdup(const char *s) {
+    char *t = strdup(s);
+    if (t == NULL) {
+        fprintf(stderr, "error: cannot allocate memory\n");
+        exit(1);
+    }
+    return (t);
+}
+
 /*
  * influxdb line protocol rules for escaping are important because the
  * zpool name can include characters that need to be escaped
@@ -142,645 +315,6128 @@ escape_string(char *s) {
 }
 
 /*
- * print_scan_status() prints the details as often seen in the "zpool status"
- * output. However, unlike the zpool command, which is intended for humans,
- * this output is suitable for long-term tracking in influxdb.
- * TODO: update to include issued scan data
+ * Line protocol writer
+ *
+ * All of the print_* functions format their lines into an lp_writer_t
+ * rather than going through printf. The writer owns a growable buffer
+ * that is handed to its sink in one piece when the pool sample is done,
+ * so stdout sees one write(2) per pool. If batch_max is set, the buffer
+ * is also flushed whenever it grows past batch_max bytes, at a line
+ * boundary.
+ *
+ * Integer formatting is done by hand; it is the bulk of the work for the
+ * histograms and printf's format parsing shows up in profiles.
  */
-int
-print_scan_status(nvlist_t *nvroot, const char *pool_name) {
-	uint_t c;
-	int64_t elapsed;
-	uint64_t examined, pass_exam, paused_time, paused_ts, rate;
-	uint64_t remaining_time;
-	pool_scan_stat_t *ps = NULL;
-	double pct_done;
-	char *state[DSS_NUM_STATES] = {"none", "scanning", "finished",
-	                               "canceled"};
-	char *func;
+#define LP_INITIAL_SIZE (64 * 1024)
 
-	(void) nvlist_lookup_uint64_array(nvroot,
-	    ZPOOL_CONFIG_SCAN_STATS,
-	    (uint64_t **) &ps, &c);
+typedef int (*lp_sink_f)(const char *, size_t, void *);
 
-	/*
-	 * ignore if there are no stats
-	 */
-	if (ps == NULL)
-	    return (0);
+typedef struct lp_writer {
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t batch_max;           /* 0 = no limit */
+    int nfields;                /* fields in the current line */
+    int err;                    /* sink failed since the last lp_flush() */
+    uint64_t lines;             /* lines written, for the caller's use */
+    uint64_t bytes;             /* bytes written, for the caller's use */
+    lp_sink_f sink;
+    void *sink_arg;
+} lp_writer_t;
 
-	/*
-	 * return error if state is bogus
-	 */
-	if (ps->pss_state >= DSS_NUM_STATES ||
-	    ps->pss_func >= POOL_SCAN_FUNCS) {
-	    if (complained_about_sync % 1000 == 0) {
-            fprintf(stderr, "error: cannot decode scan stats: ZFS is "
-                            "out of sync with compiled zpool_influxdb");
-            complained_about_sync++;
+/*
+ * default sink, write(2) the whole buffer to a file descriptor
+ */
+int
+lp_sink_fd(const char *buf, size_t len, void *arg) {
+    int fd = *(int *) arg;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error: cannot write output: %s\n",
+                    strerror(errno));
+            return (-1);
         }
-		return (1);
-	}
+        buf += n;
+        len -= (size_t) n;
+    }
+    return (0);
+}
 
-	switch (ps->pss_func) {
-		case POOL_SCAN_NONE:
-			func = "none_requested";
-			break;
-		case POOL_SCAN_SCRUB:
-			func = "scrub";
-			break;
-		case POOL_SCAN_RESILVER:
-			func = "resilver";
-			break;
-#ifdef POOL_SCAN_REBUILD
-		case POOL_SCAN_REBUILD:
-				func = "rebuild";
-				break;
-#endif
-		default:
-			func = "scan";
-	}
+int stdout_fd = STDOUT_FILENO;
 
-	/* overall progress */
-	examined = ps->pss_examined ? ps->pss_examined : 1;
-	pct_done = 0.0;
-	if (ps->pss_to_examine > 0)
-		pct_done = 100.0 * examined / ps->pss_to_examine;
+void
+lp_init(lp_writer_t *w, lp_sink_f sink, void *sink_arg) {
+    (void) memset(w, 0, sizeof (*w));
+    w->size = LP_INITIAL_SIZE;
+    if ((w->buf = malloc(w->size)) == NULL) {
+        fprintf(stderr, "error: cannot allocate memory\n");
+        exit(1);
+    }
+    w->sink = sink;
+    w->sink_arg = sink_arg;
+}
 
-#ifdef EZFS_SCRUB_PAUSED
-	paused_ts = ps->pss_pass_scrub_pause;
-	paused_time = ps->pss_pass_scrub_spent_paused;
-#else
-	paused_ts = 0;
-	paused_time = 0;
-#endif
+/*
+ * hand the buffer to the sink, the buffer is emptied even if that fails
+ *
+ * Returns non-zero if this or any batch flush since the last call failed.
+ */
+int
+lp_flush_batch(lp_writer_t *w) {
+    if (w->len > 0 && w->sink != NULL &&
+        w->sink(w->buf, w->len, w->sink_arg) != 0) {
+        w->err = 1;
+    }
+    w->bytes += w->len;
+    w->len = 0;
+    return (w->err);
+}
 
-	/* calculations for this pass */
-	if (ps->pss_state == DSS_SCANNING) {
-		elapsed = (int64_t) time(NULL) - (int64_t) ps->pss_pass_start -
-		          (int64_t) paused_time;
-		elapsed = (elapsed > 0) ? elapsed : 1;
-		pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
-		rate = pass_exam / elapsed;
-		rate = (rate > 0) ? rate : 1;
-		remaining_time = ps->pss_to_examine - examined / rate;
-	} else {
-		elapsed =
-		    (int64_t) ps->pss_end_time - (int64_t) ps->pss_pass_start -
-		    (int64_t) paused_time;
-		elapsed = (elapsed > 0) ? elapsed : 1;
-		pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
-		rate = pass_exam / elapsed;
-		remaining_time = 0;
-	}
-	rate = rate ? rate : 1;
+int
+lp_flush(lp_writer_t *w) {
+    int err = lp_flush_batch(w);
 
-	/* influxdb line protocol format: "tags metrics timestamp" */
-	(void) printf("%s,function=%s,name=%s,state=%s ",
-	    SCAN_MEASUREMENT, func, pool_name, state[ps->pss_state]);
-	(void) printf("end_ts="IFMT",errors="IFMT",examined="IFMT","
-	              "pass_examined="IFMT",pause_ts="IFMT",paused_t="IFMT","
-	              "pct_done=%.2f,processed="IFMT",rate="IFMT","
-	              "remaining_t="IFMT",start_ts="IFMT","
-	              "to_examine="IFMT",to_process="IFMT" ",
-	    MASK_UINT64(ps->pss_end_time),
-	    MASK_UINT64(ps->pss_errors),
-	    MASK_UINT64(examined),
-	    MASK_UINT64(pass_exam),
-	    MASK_UINT64(paused_ts),
-	    MASK_UINT64(paused_time),
-	    pct_done,
-	    MASK_UINT64(ps->pss_processed),
-	    MASK_UINT64(rate),
-	    MASK_UINT64(remaining_time),
-	    MASK_UINT64(ps->pss_start_time),
-	    MASK_UINT64(ps->pss_to_examine),
-	    MASK_UINT64(ps->pss_to_process)
-	);
-	(void) printf("%lu\n", timestamp);
-	return (0);
+    w->err = 0;
+    return (err);
+}
+
+static inline void
+lp_reserve(lp_writer_t *w, size_t n) {
+    if (w->len + n <= w->size)
+        return;
+    while (w->len + n > w->size)
+        w->size *= 2;
+    w->buf = safe_realloc(w->buf, w->size);
+}
+
+static inline void
+lp_putc(lp_writer_t *w, char c) {
+    lp_reserve(w, 1);
+    w->buf[w->len++] = c;
+}
+
+static inline void
+lp_puts(lp_writer_t *w, const char *s) {
+    size_t n = strlen(s);
+
+    lp_reserve(w, n);
+    (void) memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static inline void
+lp_u64(lp_writer_t *w, uint64_t v) {
+    char tmp[20];
+    int i = sizeof (tmp);
+
+    do {
+        tmp[--i] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    lp_reserve(w, sizeof (tmp) - i);
+    (void) memcpy(w->buf + w->len, tmp + i, sizeof (tmp) - i);
+    w->len += sizeof (tmp) - i;
 }
 
 /*
- * get a vdev name that corresponds to the top-level vdev names
- * printed by `zpool status`
+ * fixed-point formatting of a non-negative double, like "%.<prec>f"
  */
-char *
-get_vdev_name(nvlist_t *nvroot, const char *parent_name) {
-    static char vdev_name[256];
-    char *vdev_type = NULL;
-    uint64_t vdev_id = 0;
+static inline void
+lp_fixed(lp_writer_t *w, double v, int prec) {
+    uint64_t scale = 1, n;
 
-    if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE,
-                             &vdev_type) != 0) {
-        vdev_type = "unknown";
+    for (int i = 0; i < prec; i++)
+        scale *= 10;
+    n = (uint64_t) (v * (double) scale + 0.5);
+    lp_u64(w, n / scale);
+    if (prec > 0) {
+        lp_putc(w, '.');
+        n %= scale;
+        for (scale /= 10; scale > n && scale > 1; scale /= 10)
+            lp_putc(w, '0');
+        lp_u64(w, n);
     }
-    if (nvlist_lookup_uint64(
-        nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
-        vdev_id = UINT64_MAX;
-    }
-    if (parent_name == NULL) {
-        (void) snprintf(vdev_name, sizeof(vdev_name), "%s",
-                        vdev_type);
-    } else {
-        (void) snprintf(vdev_name, sizeof(vdev_name),
-                        "%s/%s-%lu",
-                        parent_name, vdev_type, vdev_id);
-    }
-    return (vdev_name);
 }
 
 /*
- * get a string suitable for an influxdb tag that describes this vdev
- *
- * By default only the vdev hierarchical name is shown, separated by '/'
- * If the vdev has an associated path, which is typical of leaf vdevs,
- * then the path is added.
- * It would be nice to have the devid instead of the path, but under
- * Linux we cannot be sure a devid will exist and we'd rather have
- * something than nothing, so we'll use path instead.
+ * start a line with its measurement name; tags and then fields follow
  */
-char *
-get_vdev_desc(nvlist_t *nvroot, const char *parent_name) {
-    static char vdev_desc[2 * MAXPATHLEN];
-    char *vdev_type = NULL;
-    uint64_t vdev_id = 0;
-    char vdev_value[MAXPATHLEN];
-    char *vdev_path = NULL;
-    char *s, *t;
+static inline void
+lp_measurement(lp_writer_t *w, const char *measurement) {
+    lp_puts(w, measurement);
+    w->nfields = 0;
+}
 
-    if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE, &vdev_type) != 0) {
-        vdev_type = "unknown";
-    }
-    if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
-        vdev_id = UINT64_MAX;
-    }
-    if (nvlist_lookup_string(
-        nvroot, ZPOOL_CONFIG_PATH, &vdev_path) != 0) {
-        vdev_path = NULL;
-    }
+/*
+ * add a tag, the value must already be escaped
+ */
+static inline void
+lp_tag(lp_writer_t *w, const char *key, const char *value) {
+    lp_putc(w, ',');
+    lp_puts(w, key);
+    lp_putc(w, '=');
+    lp_puts(w, value);
+}
 
-    if (parent_name == NULL) {
-        s = escape_string(vdev_type);
-        (void) snprintf(vdev_value, sizeof(vdev_value), "vdev=%s", s);
-        free(s);
-    } else {
-        s = escape_string((char *)parent_name);
-        t = escape_string(vdev_type);
-        (void) snprintf(vdev_value, sizeof(vdev_value),
-                        "vdev=%s/%s-%lu", s, t, vdev_id);
-        free(s);
-        free(t);
-    }
-    if (vdev_path == NULL) {
-        (void) snprintf(vdev_desc, sizeof(vdev_desc), "%s",
-                        vdev_value);
+/*
+ * add a preformatted, escaped "key=value[,key=value]" tag string
+ */
+static inline void
+lp_tags(lp_writer_t *w, const char *tags) {
+    lp_putc(w, ',');
+    lp_puts(w, tags);
+}
+
+static inline void
+lp_field_name(lp_writer_t *w, const char *key) {
+    lp_putc(w, w->nfields++ ? ',' : ' ');
+    lp_puts(w, key);
+    lp_putc(w, '=');
+}
+
+/*
+ * add an integer field, with the same type suffix as IFMT
+ */
+static inline void
+lp_field_uint(lp_writer_t *w, const char *key, uint64_t value) {
+    lp_field_name(w, key);
+    lp_u64(w, value);
+    lp_putc(w, IFMT_SUFFIX);
+}
+
+/*
+ * add a signed integer field, always with the "i" suffix
+ */
+static inline void
+lp_field_int(lp_writer_t *w, const char *key, int64_t value) {
+    lp_field_name(w, key);
+    if (value < 0) {
+        lp_putc(w, '-');
+        lp_u64(w, 0 - (uint64_t) value);
     } else {
-        s = escape_string(vdev_path);
-        (void) snprintf(vdev_desc, sizeof(vdev_desc), "path=%s,%s",
-                        s, vdev_value);
-        free(s);
+        lp_u64(w, (uint64_t) value);
     }
-    return (vdev_desc);
+    lp_putc(w, 'i');
+}
+
+static inline void
+lp_field_fixed(lp_writer_t *w, const char *key, double value, int prec) {
+    lp_field_name(w, key);
+    lp_fixed(w, value, prec);
 }
 
 /*
- * vdev summary stats are a combination of the data shown by
- * `zpool status` and `zpool list -v`
+ * finish the line with its timestamp
  */
-int
-print_summary_stats(nvlist_t *nvroot, const char *pool_name,
-                    const char *parent_name) {
-    uint_t c;
-    vdev_stat_t *vs;
-    char *vdev_desc = NULL;
-    vdev_desc = get_vdev_desc(nvroot, parent_name);
+static inline void
+lp_end(lp_writer_t *w, uint64_t ts) {
+    lp_putc(w, ' ');
+    lp_u64(w, ts);
+    lp_putc(w, '\n');
+    w->lines++;
+    if (w->batch_max > 0 && w->len >= w->batch_max)
+        (void) lp_flush_batch(w);
+}
 
-    if (nvlist_lookup_uint64_array(nvroot,
-                                   ZPOOL_CONFIG_VDEV_STATS,
-                                   (uint64_t **) &vs, &c) != 0) {
-        return (1);
+lp_writer_t output_writer;
+
+uint64_t
+clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts) != 0) {
+        fprintf(stderr, "error: cannot read clock: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
-    (void) printf("%s,name=%s,state=%s,%s ", POOL_MEASUREMENT, pool_name,
-                  zpool_state_to_name((vdev_state_t) vs->vs_state,
-                                      (vdev_aux_t) vs->vs_aux),
-                                      vdev_desc);
-    (void) printf("alloc="IFMT",free="IFMT",size="IFMT","
-                  "read_bytes="IFMT",read_errors="IFMT",read_ops="IFMT","
-                  "write_bytes="IFMT",write_errors="IFMT",write_ops="IFMT","
-                  "checksum_errors="IFMT",fragmentation="IFMT"",
-                  MASK_UINT64(vs->vs_alloc),
-                  MASK_UINT64(vs->vs_space - vs->vs_alloc),
-                  MASK_UINT64(vs->vs_space),
-                  MASK_UINT64(vs->vs_bytes[ZIO_TYPE_READ]),
-                  MASK_UINT64(vs->vs_read_errors),
-                  MASK_UINT64(vs->vs_ops[ZIO_TYPE_READ]),
-                  MASK_UINT64(vs->vs_bytes[ZIO_TYPE_WRITE]),
-                  MASK_UINT64(vs->vs_write_errors),
-                  MASK_UINT64(vs->vs_ops[ZIO_TYPE_WRITE]),
-                  MASK_UINT64(vs->vs_checksum_errors),
-                  MASK_UINT64(vs->vs_fragmentation));
-    (void) printf(" %lu\n", timestamp);
-    return (0);
+    return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
 }
 
 /*
- * vdev latency stats are histograms stored as nvlist arrays of uint64.
- * Latency stats include the ZIO scheduler classes plus lower-level
- * vdev latencies.
+ * Network output
  *
- * In many cases, the top-level "root" view obscures the underlying
- * top-level vdev operations. For example, if a pool has a log, special,
- * or cache device, then each can behave very differently. It is useful
- * to see how each is responding.
+ * --output sends the line protocol straight to InfluxDB instead of stdout,
+ * either as HTTP POSTs to the 1.x /write or 2.x /api/v2/write endpoint, or
+ * as UDP datagrams. It is just another sink for the output writer, so
+ * nothing upstream of the sink knows the difference.
+ *
+ * For HTTP, the writer's flushes are collected into a pending batch that
+ * is posted at the end of a sample, or once it is --flush-interval old, or
+ * when it reaches --batch-size bytes. The connection is kept alive across
+ * posts and reopened if the server has closed it. A batch that can't be
+ * delivered is dropped rather than buffered without bound.
  */
-int
-print_vdev_latency_stats(nvlist_t *nvroot, const char *pool_name,
-                         const char *parent_name) {
-    uint_t c, end = 0;
-    nvlist_t *nv_ex;
-    char *vdev_desc = NULL;
-
-    /* short_names become part of the metric name and are influxdb-ready */
-    struct lat_lookup {
-        char *name;
-        char *short_name;
-        uint64_t sum;
-        uint64_t *array;
-    };
-    struct lat_lookup lat_type[] = {
-        {ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO,   "total_read", 0},
-        {ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO,   "total_write", 0},
-        {ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO,  "disk_read", 0},
-        {ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO,  "disk_write", 0},
-        {ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,  "sync_read", 0},
-        {ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,  "sync_write", 0},
-        {ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO, "async_read", 0},
-        {ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO, "async_write", 0},
-        {ZPOOL_CONFIG_VDEV_SCRUB_LAT_HISTO,   "scrub", 0},
-#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
-        {ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO,    "trim", 0},
+#define OUTPUT_STDOUT   0
+#define OUTPUT_HTTP     1
+#define OUTPUT_UDP      2
+#define OUTPUT_OTLP     4       /* OUTPUT_PROM is 3 */
+#define UDP_PAYLOAD     1400    /* keep datagrams within a typical MTU */
+#define NET_TIMEOUT     10      /* seconds, for connects, sends and reads */
+
+typedef struct net_output {
+    int proto;
+    char *host;
+    char *port;
+    char *path;                 /* request target, with the query string */
+    char *token;                /* for the Authorization header, or NULL */
+    int fd;                     /* -1 if not connected */
+    int gzip;
+    lp_writer_t pending;        /* HTTP lines not yet posted */
+    uint64_t first;             /* when the oldest pending line arrived */
+    lp_writer_t req;            /* request header, reused */
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    int zs_ready;
+    char *zbuf;
+    size_t zsize;
 #endif
-        {NULL,                                NULL}
-    };
+} net_output_t;
 
-    if (nvlist_lookup_nvlist(nvroot,
-                             ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-        return (6);
+net_output_t net_out = { .proto = OUTPUT_STDOUT, .fd = -1 };
+uint64_t flush_interval_ns = 0;
+
+/*
+ * parse http://host[:port]/path?query, otlp://host[:port][/path] or
+ * udp://host[:port], IPv6 addresses go in brackets
+ */
+int
+output_parse(net_output_t *o, const char *url) {
+    const char *p, *end;
+    char *host;
+
+    if (strncmp(url, "http://", 7) == 0) {
+        o->proto = OUTPUT_HTTP;
+        p = url + 7;
+    } else if (strncmp(url, "otlp://", 7) == 0) {
+        o->proto = OUTPUT_OTLP;
+        p = url + 7;
+    } else if (strncmp(url, "udp://", 6) == 0) {
+        o->proto = OUTPUT_UDP;
+        p = url + 6;
+    } else {
+        fprintf(stderr, "error: output must be an http://, otlp:// or "
+                        "udp:// URL\n");
+        return (1);
     }
 
-    vdev_desc = get_vdev_desc(nvroot, parent_name);
+    if (*p == '[') {
+        if ((end = strchr(p, ']')) == NULL)
+            goto bad;
+        host = strndup(p + 1, end - p - 1);
+        p = end + 1;
+    } else {
+        end = p + strcspn(p, ":/");
+        host = strndup(p, end - p);
+        p = end;
+    }
+    if (host == NULL || *host == '\0')
+        goto bad;
+    o->host = host;
 
-    for (int i = 0; lat_type[i].name; i++) {
-        if (nvlist_lookup_uint64_array(nv_ex,
-                                       lat_type[i].name,
-                                       &lat_type[i].array,
-                                       &c) != 0) {
-            fprintf(stderr, "error: can't get %s\n", lat_type[i].name);
-            return (3);
-        }
-        /* end count count, all of the arrays are the same size */
-        end = c - 1;
+    if (*p == ':') {
+        end = p + 1 + strcspn(p + 1, "/");
+        if (end == p + 1)
+            goto bad;
+        o->port = strndup(p + 1, end - p - 1);
+        p = end;
+    } else {
+        o->port = strdup(o->proto == OUTPUT_HTTP ? "8086" :
+                         o->proto == OUTPUT_OTLP ? "4318" : "8089");
     }
 
-    for (int bucket = 0; bucket <= end; bucket++) {
-        if (bucket < MIN_LAT_INDEX) {
-            /* don't print, but collect the sum */
-            for (int i = 0; lat_type[i].name; i++) {
-                lat_type[i].sum += lat_type[i].array[bucket];
-            }
-            continue;
-        }
-        if (bucket < end) {
-            printf("%s,le=%0.6f,name=%s,%s ",
-                POOL_LATENCY_MEASUREMENT, (float) (1ULL << bucket) * 1e-9,
-                pool_name, vdev_desc);
-        } else {
-            printf("%s,le=+Inf,name=%s,%s ",
-                         POOL_LATENCY_MEASUREMENT, pool_name, vdev_desc);
-        }
-        for (int i = 0; lat_type[i].name; i++) {
-            if (bucket <= MIN_LAT_INDEX || sum_histogram_buckets) {
-                lat_type[i].sum += lat_type[i].array[bucket];
-            } else {
-                lat_type[i].sum = lat_type[i].array[bucket];
-            }
-            printf("%s="IFMT, lat_type[i].short_name, lat_type[i].sum);
-            if (lat_type[i + 1].name != NULL) {
-                printf(",");
-            }
+    if (o->proto == OUTPUT_HTTP) {
+        /* the database, or org and bucket, are in the query string */
+        if (*p != '/') {
+            fprintf(stderr, "error: output URL needs a /write or "
+                            "/api/v2/write path\n");
+            return (1);
         }
-        printf(" %lu\n", timestamp);
+        o->path = strdup(p);
+        /* 1.x takes u= and p= in the query string, 2.x needs a token */
+        o->token = getenv("INFLUX_TOKEN");
+        lp_init(&o->pending, NULL, NULL);
+        lp_init(&o->req, NULL, NULL);
+    } else if (o->proto == OUTPUT_OTLP) {
+        /* the collector's OTLP/HTTP receiver */
+        o->path = strdup(*p == '\0' || strcmp(p, "/") == 0 ?
+                         "/v1/metrics" : p);
+        lp_init(&o->pending, NULL, NULL);
+        lp_init(&o->req, NULL, NULL);
+    } else if (*p != '\0' && strcmp(p, "/") != 0) {
+        goto bad;
+    }
+    if (o->port == NULL || (o->proto != OUTPUT_UDP && o->path == NULL)) {
+        fprintf(stderr, "error: cannot allocate memory\n");
+        exit(1);
     }
     return (0);
+bad:
+    fprintf(stderr, "error: cannot parse output URL: %s\n", url);
+    return (1);
 }
 
-/*
- * vdev request size stats are histograms stored as nvlist arrays of uint64.
- * Request size stats include the ZIO scheduler classes plus lower-level
- * vdev sizes. Both independent (ind) and aggregated (agg) sizes are reported.
- *
- * In many cases, the top-level "root" view obscures the underlying
- * top-level vdev operations. For example, if a pool has a log, special,
- * or cache device, then each can behave very differently. It is useful
- * to see how each is responding.
+int
+net_connect(net_output_t *o) {
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = { .tv_sec = NET_TIMEOUT };
+    int fd = -1, err, one = 1;
+
+    (void) memset(&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = o->proto == OUTPUT_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    if ((err = getaddrinfo(o->host, o->port, &hints, &res)) != 0) {
+        fprintf(stderr, "error: cannot resolve %s: %s\n", o->host,
+                gai_strerror(err));
+        return (-1);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                         ai->ai_protocol)) < 0)
+            continue;
+        /* on Linux, the send timeout also bounds connect() */
+        (void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+        (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        (void) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "error: cannot connect to %s:%s: %s\n", o->host,
+                o->port, strerror(errno));
+        return (-1);
+    }
+    if (o->proto != OUTPUT_UDP)
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    return (fd);
+}
+
+void
+net_close(net_output_t *o) {
+    if (o->fd >= 0)
+        (void) close(o->fd);
+    o->fd = -1;
+}
+
+int
+net_send(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return (-1);
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return (0);
+}
+
+/*
+ * read the response to a post and leave the connection ready for the next
+ * one, or closed if that's not possible
+ *
+ * Returns the HTTP status, or -1 if there's no response.
+ */
+int
+http_response(net_output_t *o, char *msg, size_t msglen) {
+    char buf[8192], *line, *body, *eol;
+    size_t len = 0, have, mlen;
+    uint64_t clen = 0;
+    int status, minor, keep, known = 0;
+    ssize_t n;
+
+    for (;;) {
+        if (len == sizeof (buf) - 1)
+            return (-1);
+        if ((n = read(o->fd, buf + len, sizeof (buf) - 1 - len)) < 0 &&
+            errno == EINTR)
+            continue;
+        if (n <= 0)
+            return (-1);
+        len += (size_t) n;
+        buf[len] = '\0';
+        if ((body = strstr(buf, "\r\n\r\n")) != NULL)
+            break;
+    }
+    *body = '\0';
+    body += 4;
+    if (sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2)
+        return (-1);
+    keep = minor > 0;
+
+    for (line = strstr(buf, "\r\n"); line != NULL; line = eol) {
+        line += 2;
+        if ((eol = strstr(line, "\r\n")) != NULL)
+            *eol = '\0';
+        if (strncasecmp(line, "content-length:", 15) == 0) {
+            clen = strtoull(line + 15, NULL, 10);
+            known = 1;
+        } else if (strncasecmp(line, "connection:", 11) == 0) {
+            for (char *t = line + 11; *t != '\0'; t++) {
+                if (strncasecmp(t, "close", 5) == 0)
+                    keep = 0;
+            }
+        } else if (strncasecmp(line, "transfer-encoding:", 18) == 0) {
+            known = 0;
+            keep = 0;
+        }
+    }
+    if (status == 204 || status == 304 || status / 100 == 1) {
+        clen = 0;
+        known = 1;
+    }
+    /* without a length, the end of the body can't be found */
+    if (!known)
+        keep = 0;
+
+    /* keep the start of the body for error messages, skip the rest */
+    have = len - (size_t) (body - buf);
+    mlen = have < msglen - 1 ? have : msglen - 1;
+    (void) memcpy(msg, body, mlen);
+    while (keep && have < clen) {
+        n = read(o->fd, buf, clen - have < sizeof (buf) ?
+                 clen - have : sizeof (buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            keep = 0;
+            break;
+        }
+        if (mlen < msglen - 1) {
+            size_t m = msglen - 1 - mlen < (size_t) n ?
+                       msglen - 1 - mlen : (size_t) n;
+            (void) memcpy(msg + mlen, buf, m);
+            mlen += m;
+        }
+        have += (size_t) n;
+    }
+    msg[mlen] = '\0';
+    if (!keep)
+        net_close(o);
+    return (status);
+}
+
+#ifdef HAVE_ZLIB
+int
+gzip_body(net_output_t *o, const char **body, size_t *len) {
+    size_t bound;
+
+    if (!o->zs_ready) {
+        /* 15 + 16 is a 32K window with a gzip rather than zlib wrapper */
+        if (deflateInit2(&o->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return (-1);
+        o->zs_ready = 1;
+    } else if (deflateReset(&o->zs) != Z_OK) {
+        return (-1);
+    }
+    bound = deflateBound(&o->zs, *len);
+    if (bound > o->zsize) {
+        o->zsize = bound;
+        o->zbuf = safe_realloc(o->zbuf, o->zsize);
+    }
+    o->zs.next_in = (Bytef *) *body;
+    o->zs.avail_in = *len;
+    o->zs.next_out = (Bytef *) o->zbuf;
+    o->zs.avail_out = o->zsize;
+    if (deflate(&o->zs, Z_FINISH) != Z_STREAM_END)
+        return (-1);
+    *body = o->zbuf;
+    *len = o->zs.total_out;
+    return (0);
+}
+#endif
+
+/*
+ * post the pending lines, which are dropped whether that works or not
+ */
+int
+http_post(net_output_t *o) {
+    const char *body = o->pending.buf;
+    size_t len = o->pending.len;
+    char msg[256], clen[24];
+    int status = -1, err = 0;
+
+    o->pending.len = 0;
+#ifdef HAVE_ZLIB
+    if (o->gzip && gzip_body(o, &body, &len) != 0) {
+        fprintf(stderr, "error: cannot compress output\n");
+        return (-1);
+    }
+#endif
+    (void) snprintf(clen, sizeof (clen), "%zu", len);
+    o->req.len = 0;
+    lp_puts(&o->req, "POST ");
+    lp_puts(&o->req, o->path);
+    lp_puts(&o->req, " HTTP/1.1\r\nHost: ");
+    lp_puts(&o->req, o->host);
+    lp_puts(&o->req, ":");
+    lp_puts(&o->req, o->port);
+    lp_puts(&o->req, "\r\nUser-Agent: zpool_influxdb\r\nContent-Type: ");
+    lp_puts(&o->req, o->proto == OUTPUT_OTLP ? "application/x-protobuf" :
+                     "text/plain; charset=utf-8");
+    lp_puts(&o->req, "\r\n");
+    if (o->token != NULL) {
+        lp_puts(&o->req, "Authorization: Token ");
+        lp_puts(&o->req, o->token);
+        lp_puts(&o->req, "\r\n");
+    }
+    if (o->gzip)
+        lp_puts(&o->req, "Content-Encoding: gzip\r\n");
+    lp_puts(&o->req, "Content-Length: ");
+    lp_puts(&o->req, clen);
+    lp_puts(&o->req, "\r\n\r\n");
+
+    /*
+     * the server may have closed a kept-alive connection while it was
+     * idle, so a failure on an old connection is retried on a new one.
+     * Writing the same points twice is harmless.
+     */
+    for (int tries = 0; tries < 2 && status < 0; tries++) {
+        int reused = o->fd >= 0;
+
+        if (!reused && (o->fd = net_connect(o)) < 0)
+            return (-1);
+        /* a response that is cut short or garbled sets no errno */
+        errno = 0;
+        if (net_send(o->fd, o->req.buf, o->req.len) != 0 ||
+            net_send(o->fd, body, len) != 0 ||
+            (status = http_response(o, msg, sizeof (msg))) < 0) {
+            err = errno;
+            net_close(o);
+            if (!reused)
+                break;
+        }
+    }
+    if (status < 0) {
+        fprintf(stderr, "error: cannot post to %s:%s: %s\n", o->host,
+                o->port, err ? strerror(err) : "no response");
+        return (-1);
+    }
+    if (status / 100 != 2) {
+        fprintf(stderr, "error: %s:%s returned HTTP %d: %s\n", o->host,
+                o->port, status, msg);
+        return (-1);
+    }
+    return (0);
+}
+
+int
+lp_sink_http(const char *buf, size_t len, void *arg) {
+    net_output_t *o = arg;
+
+    if (o->pending.len == 0)
+        o->first = clock_ns(CLOCK_MONOTONIC);
+    lp_reserve(&o->pending, len);
+    (void) memcpy(o->pending.buf + o->pending.len, buf, len);
+    o->pending.len += len;
+    if (batch_size > 0 && o->pending.len >= batch_size)
+        return (http_post(o));
+    return (0);
+}
+
+/*
+ * send whole lines in datagrams of up to UDP_PAYLOAD bytes, a line that's
+ * longer than that goes on its own
+ */
+int
+lp_sink_udp(const char *buf, size_t len, void *arg) {
+    net_output_t *o = arg;
+    const char *nl;
+    size_t n;
+
+    if (o->fd < 0 && (o->fd = net_connect(o)) < 0)
+        return (-1);
+    while (len > 0) {
+        n = len;
+        if (n > UDP_PAYLOAD) {
+            for (n = UDP_PAYLOAD; n > 0 && buf[n - 1] != '\n'; n--)
+                ;
+            if (n == 0) {
+                nl = memchr(buf, '\n', len);
+                n = nl != NULL ? (size_t) (nl - buf) + 1 : len;
+            }
+        }
+        if (send(o->fd, buf, n, MSG_NOSIGNAL) < 0) {
+            /* nothing went out, so the same datagram is sent again */
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error: cannot send to %s:%s: %s\n", o->host,
+                    o->port, strerror(errno));
+            net_close(o);
+            return (-1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return (0);
+}
+
+/*
+ * Prometheus output
+ *
+ * --listen serves the last sample at /metrics in the Prometheus text
+ * exposition format. Sampling stays on the --interval schedule, and a
+ * scrape only copies the published snapshot, so any number of scrapers
+ * cost nothing extra in libzfs.
+ *
+ * The conversion is a sink, like the network sinks: each line protocol
+ * field becomes a <measurement>_<field> sample with the tags as labels.
+ * Prometheus wants all the samples of a metric together, so they're
+ * collected and sorted by name, already rendered, and the snapshot is
+ * built from them at the end of the sample. Histograms are summed like
+ * --sum-histogram-buckets and named <measurement>_<field>_bucket, which
+ * is what histogram_quantile() expects.
+ */
+#define OUTPUT_PROM     3
+
+typedef struct prom_sample {
+    size_t off;                 /* of the rendered sample in prom_text */
+    size_t len;
+    size_t name_len;
+    size_t seq;                 /* keeps the order within a metric */
+} prom_sample_t;
+
+lp_writer_t prom_text;          /* rendered samples of this sample */
+prom_sample_t *prom_samples;
+size_t prom_nsamples, prom_maxsamples;
+lp_writer_t prom_next;          /* the snapshot being built */
+
+pthread_mutex_t prom_lock = PTHREAD_MUTEX_INITIALIZER;
+lp_writer_t prom_snapshot;      /* protected by prom_lock */
+int prom_listen_fd = -1;
+
+/*
+ * copy an escaped line protocol token up to an unescaped stop character,
+ * returns a pointer to the stop character or the end
+ */
+const char *
+lp_unescape(const char *p, const char *end, const char *stops,
+            char *dst, size_t len) {
+    size_t n = 0;
+
+    while (p < end && strchr(stops, *p) == NULL) {
+        if (*p == '\\' && p + 1 < end)
+            p++;
+        if (n < len - 1)
+            dst[n++] = *p;
+        p++;
+    }
+    dst[n] = '\0';
+    return (p);
+}
+
+void
+prom_label_value(lp_writer_t *w, const char *v) {
+    for (; *v != '\0'; v++) {
+        if (*v == '\\' || *v == '"') {
+            lp_putc(w, '\\');
+            lp_putc(w, *v);
+        } else if (*v == '\n') {
+            lp_puts(w, "\\n");
+        } else {
+            lp_putc(w, *v);
+        }
+    }
+}
+
+void
+prom_name(lp_writer_t *w, const char *v) {
+    for (; *v != '\0'; v++) {
+        if ((*v >= 'a' && *v <= 'z') || (*v >= 'A' && *v <= 'Z') ||
+            (*v >= '0' && *v <= '9') || *v == '_' || *v == ':')
+            lp_putc(w, *v);
+        else
+            lp_putc(w, '_');
+    }
+}
+
+/*
+ * convert one line, without its newline
+ */
+void
+prom_line(const char *p, const char *end) {
+    static lp_writer_t labels;
+    char measurement[128], key[128], value[ZFS_MAX_DATASET_NAME_LEN * 2];
+    const char *v;
+    prom_sample_t *ps;
+    int histogram = 0;
+
+    if (labels.buf == NULL)
+        lp_init(&labels, NULL, NULL);
+    labels.len = 0;
+
+    p = lp_unescape(p, end, ", ", measurement, sizeof (measurement));
+    while (p < end && *p == ',') {
+        p = lp_unescape(p + 1, end, "=", key, sizeof (key));
+        p = lp_unescape(p + 1, end, ", ", value, sizeof (value));
+        if (strcmp(key, "le") == 0)
+            histogram = 1;
+        if (labels.len > 0)
+            lp_putc(&labels, ',');
+        prom_name(&labels, key);
+        lp_puts(&labels, "=\"");
+        prom_label_value(&labels, value);
+        lp_putc(&labels, '"');
+    }
+    if (p >= end || *p != ' ')
+        return;
+
+    /* the fields, the timestamp after them is dropped */
+    do {
+        p = lp_unescape(p + 1, end, "=", key, sizeof (key));
+        if (++p >= end)
+            break;
+        if (*p == '"') {
+            /* strings have no place in Prometheus */
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\')
+                    p++;
+            }
+            p++;
+            continue;
+        }
+        for (v = p; p < end && *p != ',' && *p != ' '; p++)
+            ;
+
+        if (prom_nsamples == prom_maxsamples) {
+            prom_maxsamples = prom_maxsamples ? prom_maxsamples * 2 : 1024;
+            prom_samples = safe_realloc(prom_samples,
+                                        prom_maxsamples *
+                                        sizeof (*prom_samples));
+        }
+        ps = &prom_samples[prom_nsamples];
+        ps->seq = prom_nsamples++;
+        ps->off = prom_text.len;
+        prom_name(&prom_text, measurement);
+        lp_putc(&prom_text, '_');
+        prom_name(&prom_text, key);
+        if (histogram)
+            lp_puts(&prom_text, "_bucket");
+        ps->name_len = prom_text.len - ps->off;
+        if (labels.len > 0) {
+            lp_putc(&prom_text, '{');
+            lp_reserve(&prom_text, labels.len);
+            (void) memcpy(prom_text.buf + prom_text.len, labels.buf,
+                          labels.len);
+            prom_text.len += labels.len;
+            lp_putc(&prom_text, '}');
+        }
+        lp_putc(&prom_text, ' ');
+        /* integers lose their type suffix */
+        if (p > v && (p[-1] == 'u' || p[-1] == 'i'))
+            p--;
+        lp_reserve(&prom_text, p - v);
+        (void) memcpy(prom_text.buf + prom_text.len, v, p - v);
+        prom_text.len += p - v;
+        if (*p == 'u' || *p == 'i')
+            p++;
+        lp_putc(&prom_text, '\n');
+        ps->len = prom_text.len - ps->off;
+    } while (p < end && *p == ',');
+}
+
+int
+lp_sink_prom(const char *buf, size_t len, void *arg) {
+    const char *end = buf + len, *nl;
+
+    for (; buf < end; buf = nl + 1) {
+        if ((nl = memchr(buf, '\n', end - buf)) == NULL)
+            nl = end;
+        prom_line(buf, nl);
+    }
+    return (0);
+}
+
+int
+prom_sample_cmp(const void *a, const void *b) {
+    const prom_sample_t *x = a, *y = b;
+    size_t n = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int r = memcmp(prom_text.buf + x->off, prom_text.buf + y->off, n);
+
+    if (r == 0 && x->name_len != y->name_len)
+        r = x->name_len < y->name_len ? -1 : 1;
+    if (r == 0)
+        r = x->seq < y->seq ? -1 : 1;
+    return (r);
+}
+
+/*
+ * make this sample's metrics the ones served
+ */
+void
+prom_publish(void) {
+    lp_writer_t tmp;
+
+    qsort(prom_samples, prom_nsamples, sizeof (*prom_samples),
+          prom_sample_cmp);
+    prom_next.len = 0;
+    for (size_t i = 0; i < prom_nsamples; i++) {
+        lp_reserve(&prom_next, prom_samples[i].len);
+        (void) memcpy(prom_next.buf + prom_next.len,
+                      prom_text.buf + prom_samples[i].off,
+                      prom_samples[i].len);
+        prom_next.len += prom_samples[i].len;
+    }
+    prom_text.len = 0;
+    prom_nsamples = 0;
+
+    /* swap the buffers, the old snapshot is reused for the next one */
+    (void) pthread_mutex_lock(&prom_lock);
+    tmp = prom_snapshot;
+    prom_snapshot = prom_next;
+    prom_next = tmp;
+    (void) pthread_mutex_unlock(&prom_lock);
+}
+
+int
+prom_open(const char *addr) {
+    struct addrinfo hints, *res, *ai;
+    char *host = NULL, *port, *colon;
+    int fd = -1, err, one = 1;
+
+    if ((colon = strrchr(addr, ':')) != NULL) {
+        host = strndup(addr, colon - addr);
+        port = colon + 1;
+        /* [::1]:9100 */
+        if (host != NULL && host[0] == '[' &&
+            host[strlen(host) - 1] == ']') {
+            host[strlen(host) - 1] = '\0';
+            (void) memmove(host, host + 1, strlen(host));
+        }
+    } else {
+        port = (char *) addr;
+    }
+
+    (void) memset(&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(host != NULL && *host != '\0' ? host : NULL, port,
+                           &hints, &res)) != 0) {
+        fprintf(stderr, "error: cannot resolve %s: %s\n", addr,
+                gai_strerror(err));
+        free(host);
+        return (-1);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                         ai->ai_protocol)) < 0)
+            continue;
+        (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, 16) == 0)
+            break;
+        (void) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    free(host);
+    if (fd < 0)
+        fprintf(stderr, "error: cannot listen on %s: %s\n", addr,
+                strerror(errno));
+    return (fd);
+}
+
+/*
+ * answer one scrape, the connection is closed afterwards
+ */
+void
+prom_serve(int fd, lp_writer_t *copy) {
+    struct timeval tv = { .tv_sec = NET_TIMEOUT };
+    char req[4096], hdr[256];
+    size_t len = 0;
+    ssize_t n;
+    int hlen;
+
+    (void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    for (;;) {
+        if ((n = read(fd, req + len, sizeof (req) - 1 - len)) < 0 &&
+            errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        len += (size_t) n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+            break;
+        if (len == sizeof (req) - 1)
+            return;
+    }
+
+    if (strncmp(req, "GET /metrics ", 13) != 0 &&
+        strncmp(req, "GET /metrics?", 13) != 0) {
+        const char *nf = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                         "Connection: close\r\n\r\n";
+
+        (void) net_send(fd, nf, strlen(nf));
+        return;
+    }
+
+    /* copy, so a slow scraper doesn't hold up the next sample */
+    (void) pthread_mutex_lock(&prom_lock);
+    copy->len = 0;
+    lp_reserve(copy, prom_snapshot.len);
+    if (prom_snapshot.len > 0)
+        (void) memcpy(copy->buf, prom_snapshot.buf, prom_snapshot.len);
+    copy->len = prom_snapshot.len;
+    (void) pthread_mutex_unlock(&prom_lock);
+
+    hlen = snprintf(hdr, sizeof (hdr), "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                    copy->len);
+    if (net_send(fd, hdr, (size_t) hlen) == 0)
+        (void) net_send(fd, copy->buf, copy->len);
+}
+
+void *
+prom_listener(void *arg) {
+    lp_writer_t copy;
+    int fd;
+
+    lp_init(&copy, NULL, NULL);
+    for (;;) {
+        if ((fd = accept(prom_listen_fd, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "error: cannot accept scrape: %s\n",
+                        strerror(errno));
+            continue;
+        }
+        prom_serve(fd, &copy);
+        (void) close(fd);
+    }
+    return (NULL);
+}
+
+int
+prom_start(const char *addr) {
+    pthread_t tid;
+    int err;
+
+    if ((prom_listen_fd = prom_open(addr)) < 0)
+        return (1);
+    lp_init(&prom_text, NULL, NULL);
+    lp_init(&prom_next, NULL, NULL);
+    lp_init(&prom_snapshot, NULL, NULL);
+    if ((err = pthread_create(&tid, NULL, prom_listener, NULL)) != 0) {
+        fprintf(stderr, "error: cannot create listener thread: %s\n",
+                strerror(err));
+        return (1);
+    }
+    (void) pthread_detach(tid);
+    return (0);
+}
+
+/*
+ * histogram "le" tag values, formatted once at startup
+ */
+#define MAX_HISTO_BUCKETS 64
+char lat_le[MAX_HISTO_BUCKETS][24];
+char size_le[MAX_HISTO_BUCKETS][24];
+
+/*
+ * the histogram buckets to print, as bucket indexes, set with
+ * --latency-range, --size-range and --bucket-factor
+ */
+typedef struct histo_range {
+    uint_t min;         /* the smaller buckets are summed into this one */
+    uint_t max;         /* the larger buckets are summed into +Inf */
+    uint_t step;        /* print every step'th bucket from min */
+} histo_range_t;
+
+histo_range_t lat_range = { MIN_LAT_INDEX, MAX_HISTO_BUCKETS - 1, 1 };
+histo_range_t size_range = { MIN_SIZE_INDEX, MAX_HISTO_BUCKETS - 1, 1 };
+
+void
+init_histogram_tags(void) {
+    for (int b = 0; b < MAX_HISTO_BUCKETS; b++) {
+        /* OTLP wants them exact, as it makes them bucket indexes again */
+        if (net_out.proto == OUTPUT_OTLP)
+            (void) snprintf(lat_le[b], sizeof (lat_le[b]), "%llu",
+                            1ULL << b);
+        else
+            (void) snprintf(lat_le[b], sizeof (lat_le[b]), "%0.6f",
+                            (float) (1ULL << b) * 1e-9);
+        (void) snprintf(size_le[b], sizeof (size_le[b]), "%llu", 1ULL << b);
+    }
+}
+
+typedef struct histo_unit {
+    const char *suffix;
+    double scale;
+} histo_unit_t;
+
+histo_unit_t lat_units[] = {
+    {"ns", 1}, {"us", 1e3}, {"ms", 1e6}, {"s", 1e9}, {NULL, 0}
+};
+histo_unit_t size_units[] = {
+    {"", 1}, {"k", 1024.0}, {"m", 1024.0 * 1024},
+    {"g", 1024.0 * 1024 * 1024}, {NULL, 0}
+};
+
+/*
+ * convert a value with a unit to the index of the bucket it falls in,
+ * the smallest power of 2 at least as large
+ */
+int
+histo_bucket_parse(const char *arg, size_t len, const histo_unit_t *units,
+                   uint_t *bucket) {
+    char buf[32];
+    char *end;
+    double v;
+    uint_t b;
+
+    if (len == 0 || len >= sizeof (buf))
+        return (1);
+    (void) memcpy(buf, arg, len);
+    buf[len] = '\0';
+    errno = 0;
+    v = strtod(buf, &end);
+    if (errno != 0 || end == buf || v < 1)
+        return (1);
+    for (; units->suffix != NULL; units++) {
+        if (strcasecmp(end, units->suffix) == 0)
+            break;
+    }
+    if (units->suffix == NULL)
+        return (1);
+    v *= units->scale;
+    for (b = 0; b < MAX_HISTO_BUCKETS - 1 && (double) (1ULL << b) < v; b++)
+        ;
+    *bucket = b;
+    return (0);
+}
+
+/*
+ * parse a --latency-range or --size-range of MIN:MAX, either of which can
+ * be left out to keep the default
+ */
+int
+histo_range_parse(const char *arg, const histo_unit_t *units,
+                  histo_range_t *range) {
+    const char *colon = strchr(arg, ':');
+    uint_t min = range->min, max = range->max;
+
+    if (colon == NULL ||
+        (colon != arg &&
+         histo_bucket_parse(arg, colon - arg, units, &min) != 0) ||
+        (colon[1] != '\0' &&
+         histo_bucket_parse(colon + 1, strlen(colon + 1), units, &max) != 0)
+        || min > max) {
+        fprintf(stderr, "error: invalid histogram range: %s\n", arg);
+        return (1);
+    }
+    range->min = min;
+    range->max = max;
+    return (0);
+}
+
+/*
+ * OpenTelemetry output
+ *
+ * An otlp:// --output posts the samples to an OpenTelemetry collector as
+ * OTLP/HTTP protobuf ExportMetricsServiceRequests. Like --listen, it is a
+ * sink that converts the line protocol: each field becomes a gauge
+ * <measurement>_<field> with the tags as string attributes. The exception
+ * is the histograms. ZFS counts latencies and sizes in power of 2 buckets,
+ * which are the buckets of an exponential histogram at scale 0, so a
+ * vdev's "le" lines are folded back into one exponential histogram data
+ * point per field rather than sent as a gauge per bucket. The printed
+ * bucket with le=2^b holds (2^(b-1), 2^b], which is index b-1. For that to
+ * work, the latency "le" tags are in nanoseconds rather than seconds, the
+ * last bucket is printed with le=2^end rather than "+Inf" and the buckets
+ * aren't summed or merged. Unless they are --histogram-deltas, the points
+ * are cumulative from when zpool_influxdb started.
+ *
+ * The data points are encoded as the lines arrive. They are collected by
+ * metric name, as for Prometheus, and the request is built around them
+ * when the output is flushed.
+ */
+#define OTLP_HISTO_FIELDS   SIZE_TYPES_MAX
+#define OTLP_NAME_LEN       128 /* of a measurement, field or tag */
+
+#define PB_VARINT   0           /* protobuf wire types */
+#define PB_FIXED64  1
+#define PB_BYTES    2
+
+typedef struct otlp_point {
+    size_t off;                 /* of the metric name in otlp_text */
+    size_t name_len;
+    size_t len;                 /* the name and the encoded data point */
+    size_t seq;
+    int histogram;
+} otlp_point_t;
+
+/*
+ * the histogram lines of one vdev and measurement, until they're all in
+ */
+typedef struct otlp_histo {
+    lp_writer_t key;            /* the measurement, then the attributes */
+    size_t measurement_len;
+    uint64_t ts;
+    uint_t nfields;
+    char names[OTLP_HISTO_FIELDS][OTLP_NAME_LEN];
+    /* by bucket index + 1, as the smallest index is -1 */
+    uint64_t counts[OTLP_HISTO_FIELDS][MAX_HISTO_BUCKETS + 2];
+    int first;                  /* bucket indexes seen, + 1 */
+    int last;                   /* -1 if there are none */
+} otlp_histo_t;
+
+lp_writer_t otlp_text;          /* names and encoded data points */
+otlp_point_t *otlp_points;
+size_t otlp_npoints, otlp_maxpoints;
+otlp_histo_t otlp_histo = { .last = -1 };
+lp_writer_t otlp_scratch[4];    /* for the nested messages */
+uint64_t otlp_first;            /* when the oldest point arrived */
+uint64_t otlp_start_time;       /* the cumulative points' start */
+
+void
+pb_varint(lp_writer_t *w, uint64_t v) {
+    lp_reserve(w, 10);
+    while (v >= 0x80) {
+        w->buf[w->len++] = (char) (v | 0x80);
+        v >>= 7;
+    }
+    w->buf[w->len++] = (char) v;
+}
+
+/*
+ * sint32 and sint64 are zigzag encoded, so small negatives are short
+ */
+void
+pb_sint(lp_writer_t *w, int64_t v) {
+    pb_varint(w, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+void
+pb_tag(lp_writer_t *w, uint_t field, uint_t type) {
+    pb_varint(w, (field << 3) | type);
+}
+
+void
+pb_fixed64(lp_writer_t *w, uint_t field, uint64_t v) {
+    pb_tag(w, field, PB_FIXED64);
+    lp_reserve(w, 8);
+    for (int i = 0; i < 8; i++)
+        w->buf[w->len++] = (char) (v >> (8 * i));
+}
+
+void
+pb_double(lp_writer_t *w, uint_t field, double d) {
+    uint64_t v;
+
+    (void) memcpy(&v, &d, sizeof (v));
+    pb_fixed64(w, field, v);
+}
+
+void
+pb_bytes(lp_writer_t *w, uint_t field, const char *buf, size_t len) {
+    pb_tag(w, field, PB_BYTES);
+    pb_varint(w, len);
+    lp_reserve(w, len);
+    (void) memcpy(w->buf + w->len, buf, len);
+    w->len += len;
+}
+
+void
+pb_string(lp_writer_t *w, uint_t field, const char *s) {
+    pb_bytes(w, field, s, strlen(s));
+}
+
+/*
+ * a KeyValue with a string value
+ */
+void
+otlp_attribute(lp_writer_t *w, uint_t field, const char *key,
+               const char *value) {
+    static lp_writer_t kv, any;
+
+    if (kv.buf == NULL) {
+        lp_init(&kv, NULL, NULL);
+        lp_init(&any, NULL, NULL);
+    }
+    any.len = 0;
+    pb_string(&any, 1, value);
+    kv.len = 0;
+    pb_string(&kv, 1, key);
+    pb_bytes(&kv, 2, any.buf, any.len);
+    pb_bytes(w, field, kv.buf, kv.len);
+}
+
+/*
+ * copy attributes encoded as field 1 as another field
+ */
+void
+otlp_attributes_copy(lp_writer_t *w, uint_t field, const char *p,
+                     const char *end) {
+    uint64_t len;
+    int shift;
+
+    while (p < end) {
+        p++;                    /* the tag, a single byte */
+        for (len = 0, shift = 0; *p & 0x80; p++, shift += 7)
+            len |= (uint64_t) (*p & 0x7f) << shift;
+        len |= (uint64_t) *p++ << shift;
+        pb_bytes(w, field, p, len);
+        p += len;
+    }
+}
+
+otlp_point_t *
+otlp_point(const char *measurement, size_t len, const char *field,
+           int histogram) {
+    otlp_point_t *op;
+
+    if (otlp_npoints == otlp_maxpoints) {
+        otlp_maxpoints = otlp_maxpoints ? otlp_maxpoints * 2 : 1024;
+        otlp_points = safe_realloc(otlp_points,
+                                   otlp_maxpoints * sizeof (*otlp_points));
+    }
+    if (otlp_npoints == 0)
+        otlp_first = clock_ns(CLOCK_MONOTONIC);
+    op = &otlp_points[otlp_npoints];
+    op->seq = otlp_npoints++;
+    op->off = otlp_text.len;
+    op->histogram = histogram;
+    lp_reserve(&otlp_text, len);
+    (void) memcpy(otlp_text.buf + otlp_text.len, measurement, len);
+    otlp_text.len += len;
+    lp_putc(&otlp_text, '_');
+    lp_puts(&otlp_text, field);
+    op->name_len = otlp_text.len - op->off;
+    return (op);
+}
+
+/*
+ * turn the pending histogram lines into a data point per field
+ */
+void
+otlp_histo_finish(void) {
+    otlp_histo_t *h = &otlp_histo;
+    const char *attrs = h->key.buf + h->measurement_len;
+    const char *attrs_end = h->key.buf + h->key.len;
+    lp_writer_t *buckets = &otlp_scratch[0], *packed = &otlp_scratch[1];
+    otlp_point_t *op;
+    uint64_t count;
+
+    for (uint_t i = 0; h->last >= 0 && i < h->nfields; i++) {
+        packed->len = 0;
+        count = 0;
+        for (int b = h->first; b <= h->last; b++) {
+            pb_varint(packed, h->counts[i][b]);
+            count += h->counts[i][b];
+        }
+        buckets->len = 0;
+        pb_tag(buckets, 1, PB_VARINT);
+        pb_sint(buckets, h->first - 1);         /* offset */
+        pb_bytes(buckets, 2, packed->buf, packed->len);
+
+        /* an ExponentialHistogramDataPoint */
+        op = otlp_point(h->key.buf, h->measurement_len, h->names[i], 1);
+        otlp_attributes_copy(&otlp_text, 1, attrs, attrs_end);
+        if (!histogram_deltas)
+            pb_fixed64(&otlp_text, 2, otlp_start_time);
+        pb_fixed64(&otlp_text, 3, h->ts);
+        pb_fixed64(&otlp_text, 4, count);
+        pb_tag(&otlp_text, 6, PB_VARINT);       /* scale 0 */
+        pb_varint(&otlp_text, 0);
+        pb_fixed64(&otlp_text, 7, 0);           /* zero_count */
+        pb_bytes(&otlp_text, 8, buckets->buf, buckets->len);
+        op->len = otlp_text.len - op->off;
+    }
+    h->last = -1;
+    h->key.len = 0;
+}
+
+/*
+ * add a line's buckets to the pending histogram, the fields are in p to
+ * end
+ */
+void
+otlp_histo_line(const char *measurement, lp_writer_t *attrs, const char *le,
+                uint64_t ts, const char *p, const char *end) {
+    otlp_histo_t *h = &otlp_histo;
+    size_t mlen = strlen(measurement);
+    char key[OTLP_NAME_LEN];
+    uint64_t v;
+    uint_t i;
+    int b;
+
+    /* the next vdev or measurement */
+    if (h->last >= 0 &&
+        (h->measurement_len != mlen || h->key.len != mlen + attrs->len ||
+         memcmp(h->key.buf, measurement, mlen) != 0 ||
+         memcmp(h->key.buf + mlen, attrs->buf, attrs->len) != 0))
+        otlp_histo_finish();
+    if (h->last < 0) {
+        if (h->key.buf == NULL)
+            lp_init(&h->key, NULL, NULL);
+        lp_puts(&h->key, measurement);
+        h->measurement_len = mlen;
+        lp_reserve(&h->key, attrs->len);
+        (void) memcpy(h->key.buf + h->key.len, attrs->buf, attrs->len);
+        h->key.len += attrs->len;
+        h->ts = ts;
+        h->nfields = 0;
+        (void) memset(h->counts, 0, sizeof (h->counts));
+    }
+
+    /* the index + 1 of the bucket, le is a power of 2 */
+    v = strtoull(le, NULL, 10);
+    for (b = 0; b < MAX_HISTO_BUCKETS && (1ULL << b) < v; b++)
+        ;
+    if (b > MAX_HISTO_BUCKETS + 1 || (h->last >= 0 && b <= h->last))
+        return;
+    if (h->last < 0)
+        h->first = b;
+    h->last = b;
+
+    for (i = 0; p < end && (*p == ' ' || *p == ','); i++) {
+        p = lp_unescape(p + 1, end, "=", key, sizeof (key));
+        if (i < OTLP_HISTO_FIELDS) {
+            if (i == h->nfields) {
+                (void) snprintf(h->names[i], sizeof (h->names[i]), "%s",
+                                key);
+                h->nfields++;
+            }
+            h->counts[i][b] = strtoull(p + 1, NULL, 10);
+        }
+        for (p++; p < end && *p != ',' && *p != ' '; p++)
+            ;
+    }
+}
+
+/*
+ * convert one line, without its newline
+ */
+void
+otlp_line(const char *p, const char *end) {
+    static lp_writer_t attrs;
+    char measurement[OTLP_NAME_LEN], key[OTLP_NAME_LEN];
+    char value[ZFS_MAX_DATASET_NAME_LEN * 2];
+    char le[sizeof (lat_le[0])] = "";
+    const char *fields, *ts_p, *v;
+    otlp_point_t *op;
+    uint64_t ts;
+
+    if (attrs.buf == NULL)
+        lp_init(&attrs, NULL, NULL);
+    attrs.len = 0;
+
+    p = lp_unescape(p, end, ", ", measurement, sizeof (measurement));
+    while (p < end && *p == ',') {
+        p = lp_unescape(p + 1, end, "=", key, sizeof (key));
+        p = lp_unescape(p + 1, end, ", ", value, sizeof (value));
+        if (strcmp(key, "le") == 0) {
+            /* not a bucket that print_histogram_buckets() prints */
+            if (strlen(value) >= sizeof (le))
+                return;
+            (void) strcpy(le, value);
+        } else
+            otlp_attribute(&attrs, 1, key, value);
+    }
+    if (p >= end || *p != ' ')
+        return;
+    /* the timestamp is after the last space */
+    for (ts_p = end; ts_p > p && ts_p[-1] != ' '; ts_p--)
+        ;
+    if (ts_p <= p + 1)
+        return;
+    ts = strtoull(ts_p, NULL, 10);
+    fields = p;
+    end = ts_p - 1;
+
+    if (le[0] != '\0') {
+        otlp_histo_line(measurement, &attrs, le, ts, fields, end);
+        return;
+    }
+    /* the histograms are always printed one after the other */
+    otlp_histo_finish();
+
+    do {
+        p = lp_unescape(p + 1, end, "=", key, sizeof (key));
+        if (++p >= end)
+            break;
+        if (*p == '"') {
+            /* strings aren't metrics */
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\')
+                    p++;
+            }
+            p++;
+            continue;
+        }
+        for (v = p; p < end && *p != ',' && *p != ' '; p++)
+            ;
+
+        /* a NumberDataPoint */
+        op = otlp_point(measurement, strlen(measurement), key, 0);
+        otlp_attributes_copy(&otlp_text, 7, attrs.buf, attrs.buf + attrs.len);
+        pb_fixed64(&otlp_text, 3, ts);
+        if (p[-1] == 'u')
+            pb_fixed64(&otlp_text, 6, MASK_UINT64(strtoull(v, NULL, 10)));
+        else if (p[-1] == 'i')
+            pb_fixed64(&otlp_text, 6, (uint64_t) strtoll(v, NULL, 10));
+        else
+            pb_double(&otlp_text, 4, strtod(v, NULL));
+        op->len = otlp_text.len - op->off;
+    } while (p < end && *p == ',');
+}
+
+int
+lp_sink_otlp(const char *buf, size_t len, void *arg) {
+    const char *end = buf + len, *nl;
+
+    for (; buf < end; buf = nl + 1) {
+        if ((nl = memchr(buf, '\n', end - buf)) == NULL)
+            nl = end;
+        otlp_line(buf, nl);
+    }
+    return (0);
+}
+
+int
+otlp_point_cmp(const void *a, const void *b) {
+    const otlp_point_t *x = a, *y = b;
+    size_t n = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int r = memcmp(otlp_text.buf + x->off, otlp_text.buf + y->off, n);
+
+    if (r == 0 && x->name_len != y->name_len)
+        r = x->name_len < y->name_len ? -1 : 1;
+    if (r == 0)
+        r = x->seq < y->seq ? -1 : 1;
+    return (r);
+}
+
+/*
+ * build the ExportMetricsServiceRequest for the points collected so far
+ * into o->pending, and start over
+ */
+void
+otlp_encode(net_output_t *o) {
+    static char host[256];
+    lp_writer_t *metric = &otlp_scratch[0], *data = &otlp_scratch[1];
+    lp_writer_t *scope = &otlp_scratch[2], *rm = &otlp_scratch[3];
+    otlp_point_t *op, *next;
+    const char *name;
+    size_t name_len;
+
+    qsort(otlp_points, otlp_npoints, sizeof (*otlp_points), otlp_point_cmp);
+
+    /* ScopeMetrics: the scope, then a Metric per name */
+    scope->len = 0;
+    data->len = 0;
+    pb_string(data, 1, "zpool_influxdb");
+    pb_bytes(scope, 1, data->buf, data->len);
+    for (size_t i = 0; i < otlp_npoints; i = (size_t) (next - otlp_points)) {
+        op = &otlp_points[i];
+        name = otlp_text.buf + op->off;
+        name_len = op->name_len;
+        data->len = 0;
+        for (next = op; next < otlp_points + otlp_npoints &&
+             next->name_len == name_len &&
+             memcmp(otlp_text.buf + next->off, name, name_len) == 0; next++)
+            pb_bytes(data, 1, otlp_text.buf + next->off + name_len,
+                     next->len - name_len);
+        metric->len = 0;
+        pb_bytes(metric, 1, name, name_len);
+        if (op->histogram) {
+            if (strncmp(name, POOL_LATENCY_MEASUREMENT "_",
+                        strlen(POOL_LATENCY_MEASUREMENT) + 1) == 0 ||
+                strncmp(name, CLASS_LATENCY_MEASUREMENT "_",
+                        strlen(CLASS_LATENCY_MEASUREMENT) + 1) == 0)
+                pb_string(metric, 3, "ns");
+            else
+                pb_string(metric, 3, "By");
+            /* AggregationTemporality DELTA is 1, CUMULATIVE is 2 */
+            pb_tag(data, 2, PB_VARINT);
+            pb_varint(data, histogram_deltas ? 1 : 2);
+            pb_bytes(metric, 10, data->buf, data->len);
+        } else {
+            pb_bytes(metric, 5, data->buf, data->len);
+        }
+        pb_bytes(scope, 2, metric->buf, metric->len);
+    }
+    otlp_text.len = 0;
+    otlp_npoints = 0;
+
+    /* a Resource for this host, and the rest in ResourceMetrics */
+    if (host[0] == '\0' && gethostname(host, sizeof (host) - 1) != 0)
+        (void) strcpy(host, "localhost");
+    rm->len = 0;
+    data->len = 0;
+    otlp_attribute(data, 1, "service.name", "zpool_influxdb");
+    otlp_attribute(data, 1, "host.name", host);
+    pb_bytes(rm, 1, data->buf, data->len);
+    pb_bytes(rm, 2, scope->buf, scope->len);
+
+    o->pending.len = 0;
+    pb_bytes(&o->pending, 1, rm->buf, rm->len);
+}
+
+void
+otlp_start(void) {
+    otlp_start_time = clock_ns(CLOCK_REALTIME);
+    lp_init(&otlp_text, NULL, NULL);
+    for (int i = 0; i < 4; i++)
+        lp_init(&otlp_scratch[i], NULL, NULL);
+}
+
+/*
+ * called at the end of each sample, posts the pending lines if they're
+ * due, or regardless if force is set
+ */
+int
+output_flush(int force) {
+    if (net_out.proto == OUTPUT_PROM) {
+        prom_publish();
+        return (0);
+    }
+    if (net_out.proto == OUTPUT_OTLP) {
+        otlp_histo_finish();
+        if (otlp_npoints == 0)
+            return (0);
+        if (!force && flush_interval_ns != 0 &&
+            clock_ns(CLOCK_MONOTONIC) - otlp_first < flush_interval_ns)
+            return (0);
+        otlp_encode(&net_out);
+        return (http_post(&net_out));
+    }
+    if (net_out.proto != OUTPUT_HTTP || net_out.pending.len == 0)
+        return (0);
+    if (!force && flush_interval_ns != 0 &&
+        clock_ns(CLOCK_MONOTONIC) - net_out.first < flush_interval_ns)
+        return (0);
+    return (http_post(&net_out));
+}
+
+/*
+ * get a vdev name that corresponds to the top-level vdev names
+ * printed by `zpool status`
+ */
+char *
+get_vdev_name(nvlist_t *nvroot, const char *parent_name,
+              char *vdev_name, size_t len) {
+    char *vdev_type = NULL;
+    uint64_t vdev_id = 0;
+
+    if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE,
+                             &vdev_type) != 0) {
+        vdev_type = "unknown";
+    }
+    if (nvlist_lookup_uint64(
+        nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
+        vdev_id = UINT64_MAX;
+    }
+    if (parent_name == NULL) {
+        (void) snprintf(vdev_name, len, "%s",
+                        vdev_type);
+    } else {
+        (void) snprintf(vdev_name, len,
+                        "%s/%s-%lu",
+                        parent_name, vdev_type, vdev_id);
+    }
+    return (vdev_name);
+}
+
+/*
+ * get a string suitable for an influxdb tag that describes this vdev
+ *
+ * By default only the vdev hierarchical name is shown, separated by '/'
+ * If the vdev has an associated path, which is typical of leaf vdevs,
+ * then the path is added.
+ * It would be nice to have the devid instead of the path, but under
+ * Linux we cannot be sure a devid will exist and we'd rather have
+ * something than nothing, so we'll use path instead.
+ *
+ * With --guid-tags, a vdev with a GUID only gets a vdev_guid tag, which
+ * doesn't change when the disk is renamed, and the rest goes to
+ * zpool_vdev_info. full asks for the name and path anyway.
+ */
+#define VDEV_NAME_LEN 256
+#define VDEV_DESC_LEN (2 * MAXPATHLEN)
+
+char *
+get_vdev_desc(nvlist_t *nvroot, const char *parent_name,
+              char *vdev_desc, size_t len, int full) {
+    char *vdev_type = NULL;
+    uint64_t vdev_id = 0;
+    uint64_t guid;
+    char vdev_value[MAXPATHLEN];
+    char *vdev_path = NULL;
+    char *s, *t;
+
+    if (guid_tags && !full &&
+        nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_GUID, &guid) == 0 &&
+        guid != 0) {
+        (void) snprintf(vdev_desc, len, "vdev_guid=%lu", guid);
+        return (vdev_desc);
+    }
+    if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE, &vdev_type) != 0) {
+        vdev_type = "unknown";
+    }
+    if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
+        vdev_id = UINT64_MAX;
+    }
+    if (nvlist_lookup_string(
+        nvroot, ZPOOL_CONFIG_PATH, &vdev_path) != 0) {
+        vdev_path = NULL;
+    }
+
+    if (parent_name == NULL) {
+        s = escape_string(vdev_type);
+        (void) snprintf(vdev_value, sizeof(vdev_value), "vdev=%s", s);
+        free(s);
+    } else {
+        s = escape_string((char *)parent_name);
+        t = escape_string(vdev_type);
+        (void) snprintf(vdev_value, sizeof(vdev_value),
+                        "vdev=%s/%s-%lu", s, t, vdev_id);
+        free(s);
+        free(t);
+    }
+    if (vdev_path == NULL) {
+        (void) snprintf(vdev_desc, len, "%s",
+                        vdev_value);
+    } else {
+        s = escape_string(vdev_path);
+        (void) snprintf(vdev_desc, len, "path=%s,%s",
+                        s, vdev_value);
+        free(s);
+    }
+    return (vdev_desc);
+}
+
+/*
+ * The escaped pool name, vdev name and vdev desc only change when the pool
+ * config changes, so they are kept in a per-pool cache that lives across
+ * samples in execd mode. Entries are keyed by ZPOOL_CONFIG_GUID in a small
+ * open-addressed hash table. When the pool's config txg changes, or a ZFS
+ * event says the tree did, the names are built again at the next lookup
+ * but the baselines of the deltas are kept, and the vdevs that have left
+ * the tree are dropped. An entry is also rebuilt, baselines and all, if
+ * its vdev moved in the tree, for instance when a disk is attached to make
+ * a mirror, or if its path changed.
+ */
+typedef struct vdev_cache_entry {
+    uint64_t guid;              /* 0 = empty slot */
+    uint64_t parent_guid;
+    uint64_t vdev_id;
+    char *path;                 /* unescaped ZPOOL_CONFIG_PATH, or NULL */
+    char *vdev_name;            /* from get_vdev_name() */
+    char *vdev_desc;            /* from get_vdev_desc() */
+    int info_printed;           /* --guid-tags, zpool_vdev_info is out */
+    uint64_t *lat_prev;         /* latency histograms at the last sample */
+    uint_t lat_len;
+    uint64_t *size_prev;        /* size histograms at the last sample */
+    uint_t size_len;
+    uint64_t *rate_prev;        /* counters at the last sample */
+    uint_t rate_len;
+    uint64_t rate_when;         /* and when it was taken */
+    uint64_t top_ops;           /* --top-leaves baseline: ops, */
+    uint64_t top_lat_count;     /* latency histogram counts */
+    double top_lat_sum;         /* and their estimated total time */
+    int top_pick;               /* among the top leaves this sample */
+    uint_t gen;                 /* the pool's vdev_gen it was named at */
+} vdev_cache_entry_t;
+
+typedef struct leaf_rank {
+    uint64_t guid;
+    double score;
+} leaf_rank_t;
+
+/*
+ * The kstats are read from /proc/spl/kstat/zfs, or $HOST_PROC/spl/kstat/zfs
+ * as for telegraf, through a file that is opened once and read again with
+ * pread() into the same buffer each sample.
+ *
+ * A named kstat is a header line, a "name type data" line and then a line
+ * per value, with the name and type padded so the values all start in the
+ * same column. The first read builds a table of the fields in line order,
+ * after that each line is only checked against its table entry and its
+ * value is parsed where the table says. If the check fails, because the
+ * module was reloaded with other fields, the table is built again.
+ */
+#define KSTAT_DATA_INT32    1
+#define KSTAT_DATA_UINT32   2
+#define KSTAT_DATA_INT64    3
+#define KSTAT_DATA_UINT64   4
+
+typedef struct kstat_field {
+    char *name;                 /* the kstat's name */
+    char *field;                /* prefix + name */
+    size_t name_len;
+    int type;                   /* 0 = not a number, the line is skipped */
+} kstat_field_t;
+
+typedef struct kstat_reader {
+    const char *name;           /* under spl/kstat/zfs */
+    const char *prefix;         /* for the field names */
+    int fd;
+    char *buf;
+    size_t size;
+    size_t len;
+    kstat_field_t *fields;
+    uint_t nfields;
+    size_t data_col;            /* where the values start on each line */
+} kstat_reader_t;
+
+/*
+ * an objset kstat of a pool, for --datasets
+ */
+typedef struct objset_kstat {
+    uint64_t objset;
+    int fd;
+    char *dataset;              /* the name it had at the last sample */
+    char *tags;                 /* and the tags for it */
+} objset_kstat_t;
+
+/*
+ * --classes: a pool's vdevs summed by allocation class, redone each sample
+ */
+#define CLASS_NORMAL    0
+#define CLASS_LOG       1
+#define CLASS_SPECIAL   2
+#define CLASS_DEDUP     3
+#define CLASS_CACHE     4
+#define CLASS_SPARE     5
+#define CLASS_MAX       6
+
+#define CLASS_STATS     11      /* the vdev_stat_t counters summed */
+
+typedef struct class_sum {
+    uint_t vdevs;
+    uint64_t stats[CLASS_STATS];
+    uint64_t lat[LAT_TYPES_MAX * MAX_HISTO_BUCKETS];
+    uint_t lat_end;             /* 0 if there are no latency histograms */
+    uint64_t size[SIZE_TYPES_MAX * MAX_HISTO_BUCKETS];
+    uint_t size_end;
+    uint64_t *lat_prev;         /* --histogram-deltas */
+    uint_t lat_len;
+    uint64_t *size_prev;
+    uint_t size_len;
+} class_sum_t;
+
+typedef struct pool_cache {
+    struct pool_cache *next;
+    char name[ZFS_MAX_DATASET_NAME_LEN];
+    char *escaped_name;
+    uint64_t config_txg;
+    uint_t nentries;
+    uint_t size;                /* power of 2 */
+    vdev_cache_entry_t *entries;
+    leaf_rank_t *ranks;         /* --top-leaves scratch space */
+    uint_t nranks;
+    uint_t ranks_size;
+    kstat_reader_t txgs;        /* --txgs, name is NULL until opened */
+    uint64_t last_txg;          /* the last one printed */
+    kstat_reader_t objset;      /* --datasets, shared by the objsets */
+    objset_kstat_t *objsets;
+    uint_t nobjsets;
+    int objsets_stale;          /* a read failed, scan them again */
+    uint64_t *queue_window;     /* --queue-sample, a row per sample */
+    uint_t queue_rows;
+    uint_t queue_size;
+    uint64_t *queue_sorted;     /* scratch for the p99s */
+    zpi_shm_vdev_t *shm_vdevs;  /* --shm, this pool's part of the snapshot */
+    uint_t shm_n;
+    uint_t shm_size;
+    class_sum_t *classes;       /* --classes, CLASS_MAX of them */
+    uint64_t scan_start;        /* the scan at the last sample, by start */
+    uint64_t scan_func;         /* time and function, */
+    uint64_t scan_examined;     /* how far it had got */
+    uint64_t scan_issued;
+    int scan_paused;            /* whether it was paused */
+    uint64_t scan_when;         /* and when, 0 if there was none */
+    double scan_ewma;           /* the smoothed issue rate */
+#ifdef HAVE_ZFS_IOCTL_H
+    char *ioc_buf;              /* --ioctl, the packed config */
+    size_t ioc_size;
+    char *ioc_arena;            /* and where it is unpacked */
+    size_t ioc_arena_size;
+    nv_alloc_t ioc_nva;
+#endif
+    uint_t vdev_gen;            /* bumped when the names must be rebuilt */
+    int event;                  /* EVENT_* flags, under pool_cache_lock */
+    int seen;
+} pool_cache_t;
+
+#define EVENT_REBUILD   0x1     /* rebuild the vdev cache */
+#define EVENT_SAMPLE    0x2     /* print an out-of-band sample */
+
+pool_cache_t *pool_caches = NULL;
+pthread_mutex_t pool_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile int pool_events = 0;   /* --events is listening */
+
+void
+vdev_cache_entry_free(vdev_cache_entry_t *ve) {
+    free(ve->path);
+    free(ve->vdev_name);
+    free(ve->vdev_desc);
+    free(ve->lat_prev);
+    free(ve->size_prev);
+    free(ve->rate_prev);
+}
+
+void
+vdev_cache_classes_clear(pool_cache_t *pc) {
+    for (uint_t i = 0; pc->classes != NULL && i < CLASS_MAX; i++) {
+        free(pc->classes[i].lat_prev);
+        pc->classes[i].lat_prev = NULL;
+        pc->classes[i].lat_len = 0;
+        free(pc->classes[i].size_prev);
+        pc->classes[i].size_prev = NULL;
+        pc->classes[i].size_len = 0;
+    }
+}
+
+void
+vdev_cache_clear(pool_cache_t *pc) {
+    for (uint_t i = 0; i < pc->size; i++)
+        vdev_cache_entry_free(&pc->entries[i]);
+    free(pc->entries);
+    pc->entries = NULL;
+    pc->nentries = 0;
+    pc->size = 0;
+    /* the classes' histogram deltas start over with the vdevs' */
+    vdev_cache_classes_clear(pc);
+}
+
+/*
+ * find the slot for guid, which is either its entry or an empty slot
+ */
+vdev_cache_entry_t *
+vdev_cache_slot(vdev_cache_entry_t *entries, uint_t size, uint64_t guid) {
+    /* GUIDs are random, so the low bits make a fine hash */
+    uint_t i = (uint_t) guid & (size - 1);
+
+    while (entries[i].guid != 0 && entries[i].guid != guid)
+        i = (i + 1) & (size - 1);
+    return (&entries[i]);
+}
+
+void
+vdev_cache_grow(pool_cache_t *pc) {
+    uint_t size = pc->size ? pc->size * 2 : 64;
+    vdev_cache_entry_t *entries = safe_calloc(size, sizeof (*entries));
+
+    for (uint_t i = 0; i < pc->size; i++) {
+        if (pc->entries[i].guid != 0) {
+            *vdev_cache_slot(entries, size, pc->entries[i].guid) =
+                pc->entries[i];
+        }
+    }
+    free(pc->entries);
+    pc->entries = entries;
+    pc->size = size;
+}
+
+/*
+ * (re)name a vdev's entry, at the pool's vdev_gen gen
+ */
+void
+vdev_cache_name(vdev_cache_entry_t *ve, nvlist_t *nvroot,
+                const char *parent_name, uint_t gen) {
+    char vdev_name[VDEV_NAME_LEN];
+    char vdev_desc[VDEV_DESC_LEN];
+
+    ve->vdev_name = safe_strdup(get_vdev_name(nvroot, parent_name,
+                                              vdev_name, sizeof (vdev_name)));
+    ve->vdev_desc = safe_strdup(get_vdev_desc(nvroot, parent_name,
+                                              vdev_desc, sizeof (vdev_desc),
+                                              0));
+    /* --guid-tags prints the new ones */
+    ve->info_printed = 0;
+    ve->gen = gen;
+}
+
+/*
+ * after a change to the tree, drop the vdevs that weren't looked up since
+ * the one before, so they have left it, and make the others build their
+ * names again at their next lookup
+ */
+void
+vdev_cache_rebuild(pool_cache_t *pc) {
+    vdev_cache_entry_t *entries;
+    uint_t n = 0;
+
+    if (pc->size == 0)
+        return;
+    entries = safe_calloc(pc->size, sizeof (*entries));
+    for (uint_t i = 0; i < pc->size; i++) {
+        if (pc->entries[i].guid == 0)
+            continue;
+        if (pc->entries[i].gen != pc->vdev_gen) {
+            vdev_cache_entry_free(&pc->entries[i]);
+            continue;
+        }
+        *vdev_cache_slot(entries, pc->size, pc->entries[i].guid) =
+            pc->entries[i];
+        n++;
+    }
+    free(pc->entries);
+    pc->entries = entries;
+    pc->nentries = n;
+    pc->vdev_gen++;
+    /* the classes can have gained or lost vdevs */
+    vdev_cache_classes_clear(pc);
+}
+
+/*
+ * return the cached names for this vdev, building them on a miss
+ *
+ * Returns NULL if the vdev doesn't have a GUID, in which case the caller
+ * falls back to get_vdev_name() and get_vdev_desc().
+ */
+vdev_cache_entry_t *
+vdev_cache_lookup(pool_cache_t *pc, nvlist_t *nvroot,
+                  const char *parent_name, uint64_t parent_guid) {
+    vdev_cache_entry_t *ve;
+    uint64_t guid, vdev_id;
+    char *path;
+
+    if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_GUID, &guid) != 0 ||
+        guid == 0) {
+        return (NULL);
+    }
+    if (pc->size == 0 || (pc->nentries + 1) * 2 > pc->size)
+        vdev_cache_grow(pc);
+    ve = vdev_cache_slot(pc->entries, pc->size, guid);
+    /* with --events, a change to the tree bumps vdev_gen first */
+    if (ve->guid == guid && ve->gen == pc->vdev_gen && pool_events)
+        return (ve);
+
+    if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
+        vdev_id = UINT64_MAX;
+    }
+    if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_PATH, &path) != 0) {
+        path = NULL;
+    }
+    if (ve->guid == guid && ve->parent_guid == parent_guid &&
+        ve->vdev_id == vdev_id &&
+        (path == NULL ? ve->path == NULL :
+         ve->path != NULL && strcmp(path, ve->path) == 0)) {
+        if (ve->gen != pc->vdev_gen) {
+            /* the same device, only its names can have changed */
+            free(ve->vdev_name);
+            free(ve->vdev_desc);
+            vdev_cache_name(ve, nvroot, parent_name, pc->vdev_gen);
+        }
+        return (ve);
+    }
+
+    if (ve->guid == 0) {
+        pc->nentries++;
+    } else {
+        /* a different device, its history doesn't carry over */
+        vdev_cache_entry_free(ve);
+    }
+    ve->lat_prev = NULL;
+    ve->lat_len = 0;
+    ve->size_prev = NULL;
+    ve->size_len = 0;
+    ve->rate_prev = NULL;
+    ve->rate_len = 0;
+    ve->top_ops = 0;
+    ve->top_lat_count = 0;
+    ve->top_lat_sum = 0;
+    ve->top_pick = 0;
+    ve->guid = guid;
+    ve->parent_guid = parent_guid;
+    ve->vdev_id = vdev_id;
+    ve->path = path ? safe_strdup(path) : NULL;
+    vdev_cache_name(ve, nvroot, parent_name, pc->vdev_gen);
+    return (ve);
+}
+
+/*
+ * find or create the cache for a pool
+ */
+pool_cache_t *
+pool_cache_find(const char *name) {
+    pool_cache_t *pc;
+
+    (void) pthread_mutex_lock(&pool_cache_lock);
+    for (pc = pool_caches; pc != NULL; pc = pc->next) {
+        if (strcmp(pc->name, name) == 0)
+            break;
+    }
+    if (pc == NULL) {
+        pc = safe_calloc(1, sizeof (*pc));
+        (void) strncpy(pc->name, name, sizeof (pc->name));
+        pc->name[sizeof (pc->name) - 1] = '\0';
+        pc->escaped_name = escape_string(pc->name);
+        pc->txgs.fd = -1;
+        pc->objset.fd = -1;
+        pc->next = pool_caches;
+        pool_caches = pc;
+    }
+    (void) pthread_mutex_unlock(&pool_cache_lock);
+    return (pc);
+}
+
+/*
+ * and have the vdev entries named again if the pool config has changed
+ * since they were built or a ZFS event said so
+ */
+pool_cache_t *
+pool_cache_get(const char *name, nvlist_t *config) {
+    pool_cache_t *pc = pool_cache_find(name);
+    uint64_t txg;
+    int rebuild;
+
+    (void) pthread_mutex_lock(&pool_cache_lock);
+    rebuild = pc->event & EVENT_REBUILD;
+    pc->event &= ~EVENT_REBUILD;
+    (void) pthread_mutex_unlock(&pool_cache_lock);
+
+    /* the rest of the pool's cache is only used by one thread at a time */
+    if (nvlist_lookup_uint64(config, ZPOOL_CONFIG_POOL_TXG, &txg) != 0)
+        txg = 0;
+    if (txg != pc->config_txg || rebuild)
+        vdev_cache_rebuild(pc);
+    pc->config_txg = txg;
+    pc->seen = 1;
+    return (pc);
+}
+
+#ifdef HAVE_ZFS_IOCTL_H
+/*
+ * --ioctl: zpool_refresh_stats() sends ZFS_IOC_POOL_STATS with a buffer
+ * of its own and unpacks the reply into a new nvlist, with a malloc() per
+ * nvpair, that it frees at the next refresh. On pools with many disks,
+ * that is most of what a sample costs. Here the ioctl is sent on a /dev/zfs
+ * fd opened once, into a buffer kept in the pool's cache at the size the
+ * last reply took, and the reply is unpacked into an arena that is reset
+ * rather than freed, so once the buffers fit, a sample allocates nothing.
+ * The config stays valid until the pool's next refresh. libnvpair can't
+ * unpack only some of the members, but next to the vdev tree the rest of
+ * the config is a few hundred bytes.
+ */
+int zfs_ioctl = 0;
+int zfs_ioctl_fd = -1;
+
+nvlist_t *
+pool_stats_ioctl(pool_cache_t *pc) {
+    zfs_cmd_t zc;
+    nvlist_t *config;
+    size_t size, arena;
+    int err;
+
+    for (;;) {
+        if (pc->ioc_buf == NULL) {
+            pc->ioc_size = pc->ioc_size ? pc->ioc_size : 64 * 1024;
+            pc->ioc_buf = safe_calloc(1, pc->ioc_size);
+        }
+        (void) memset(&zc, 0, sizeof (zc));
+        (void) snprintf(zc.zc_name, sizeof (zc.zc_name), "%s", pc->name);
+        zc.zc_nvlist_dst = (uint64_t) (uintptr_t) pc->ioc_buf;
+        zc.zc_nvlist_dst_size = pc->ioc_size;
+        if (ioctl(zfs_ioctl_fd, ZFS_IOC_POOL_STATS, &zc) == 0)
+            break;
+        /* the size it needs, with room for the pool to grow a little */
+        if (errno == ENOMEM) {
+            free(pc->ioc_buf);
+            pc->ioc_buf = NULL;
+            pc->ioc_size = zc.zc_nvlist_dst_size +
+                zc.zc_nvlist_dst_size / 8;
+            continue;
+        }
+        /* a pool that can't be opened still has its config */
+        if (errno == ENOENT || errno == EINVAL || !zc.zc_nvlist_dst_filled)
+            return (NULL);
+        break;
+    }
+
+    /* unpacked, a config takes about four times its packed size */
+    size = zc.zc_nvlist_dst_size;
+    arena = 4 * size;
+    for (;;) {
+        if (pc->ioc_arena_size < arena) {
+            if (pc->ioc_arena != NULL)
+                nv_alloc_fini(&pc->ioc_nva);
+            free(pc->ioc_arena);
+            pc->ioc_arena_size = arena;
+            pc->ioc_arena = safe_calloc(1, pc->ioc_arena_size);
+            if (nv_alloc_init(&pc->ioc_nva, nv_fixed_ops, pc->ioc_arena,
+                              pc->ioc_arena_size) != 0) {
+                fprintf(stderr, "error: cannot allocate memory\n");
+                exit(1);
+            }
+        }
+        nv_alloc_reset(&pc->ioc_nva);
+        if ((err = nvlist_xunpack(pc->ioc_buf, size, &config,
+                                  &pc->ioc_nva)) == 0)
+            return (config);
+        if (err != ENOMEM) {
+            fprintf(stderr, "error: cannot unpack the config of %s: %s\n",
+                    pc->name, strerror(err));
+            return (NULL);
+        }
+        arena = 2 * pc->ioc_arena_size;
+    }
+}
+#endif
+
+/*
+ * refresh a pool's stats and return its config, NULL if that failed
+ */
+nvlist_t *
+pool_refresh(zpool_handle_t *zhp) {
+    boolean_t missing;
+
+#ifdef HAVE_ZFS_IOCTL_H
+    if (zfs_ioctl_fd >= 0)
+        return (pool_stats_ioctl(pool_cache_find(zhp->zpool_name)));
+#endif
+    if (zpool_refresh_stats(zhp, &missing) != 0)
+        return (NULL);
+    return (zpool_get_config(zhp, NULL));
+}
+
+void
+kstat_free_fields(kstat_reader_t *k) {
+    for (uint_t i = 0; i < k->nfields; i++) {
+        free(k->fields[i].name);
+        free(k->fields[i].field);
+    }
+    free(k->fields);
+    k->fields = NULL;
+    k->nfields = 0;
+}
+
+void
+objsets_close(pool_cache_t *pc) {
+    for (uint_t i = 0; i < pc->nobjsets; i++) {
+        (void) close(pc->objsets[i].fd);
+        free(pc->objsets[i].dataset);
+        free(pc->objsets[i].tags);
+    }
+    free(pc->objsets);
+    pc->objsets = NULL;
+    pc->nobjsets = 0;
+}
+
+/*
+ * forget pools that weren't sampled since the last prune, for instance
+ * because they were exported
+ */
+void
+pool_cache_prune(void) {
+    pool_cache_t **pp = &pool_caches;
+    pool_cache_t *pc;
+
+    while ((pc = *pp) != NULL) {
+        if (pc->seen) {
+            pc->seen = 0;
+            pp = &pc->next;
+            continue;
+        }
+        *pp = pc->next;
+        vdev_cache_clear(pc);
+        if (pc->txgs.fd >= 0)
+            (void) close(pc->txgs.fd);
+        free((char *) pc->txgs.name);
+        free(pc->txgs.buf);
+        objsets_close(pc);
+        free(pc->queue_window);
+        free(pc->queue_sorted);
+        free(pc->shm_vdevs);
+        free(pc->classes);
+#ifdef HAVE_ZFS_IOCTL_H
+        if (pc->ioc_arena != NULL)
+            nv_alloc_fini(&pc->ioc_nva);
+        free(pc->ioc_arena);
+        free(pc->ioc_buf);
+#endif
+        free((char *) pc->objset.name);
+        free(pc->objset.buf);
+        kstat_free_fields(&pc->objset);
+        free(pc->ranks);
+        free(pc->escaped_name);
+        free(pc);
+    }
+}
+
+/*
+ * state for one pool's sample, shared by everything that prints it
+ */
+typedef struct pool_sample {
+    pool_cache_t *pc;
+    lp_writer_t *out;
+    uint64_t timestamp;
+    uint64_t hrtime;            /* CLOCK_MONOTONIC when it was refreshed */
+    uint_t vdevs;               /* vdevs printed */
+    uint64_t refresh_time;      /* for --internal-stats */
+    int event;                  /* out-of-band, after a ZFS event */
+} pool_sample_t;
+
+/*
+ * Everything the per-vdev printers need is looked up once per vdev by
+ * walk_vdev_tree() and handed to each printer, rather than having each
+ * printer repeat the nvlist lookups and the name/desc formatting.
+ */
+typedef struct vdev_info {
+    lp_writer_t *out;
+    uint64_t timestamp;
+    uint64_t hrtime;
+    nvlist_t *nvroot;           /* this vdev's config */
+    nvlist_t *nv_ex;            /* ZPOOL_CONFIG_VDEV_STATS_EX, or NULL */
+    struct stats_ex *sx;        /* decoded by vdev_stats_ex() */
+    int sx_decoded;
+    pool_cache_t *pc;
+    const char *pool_name;      /* escaped pool name */
+    const char *parent_name;    /* NULL for the root vdev */
+    int depth;                  /* 0 for the root vdev */
+    const char *vdev_desc;      /* tags from get_vdev_desc() */
+    vdev_cache_entry_t *ve;     /* NULL if the vdev has no GUID */
+} vdev_info_t;
+
+/*
+ * vdev summary stats are a combination of the data shown by
+ * `zpool status` and `zpool list -v`
+ */
+int
+print_summary_stats(vdev_info_t *vi) {
+    lp_writer_t *out = vi->out;
+    uint_t c;
+    vdev_stat_t *vs;
+
+    if (nvlist_lookup_uint64_array(vi->nvroot,
+                                   ZPOOL_CONFIG_VDEV_STATS,
+                                   (uint64_t **) &vs, &c) != 0) {
+        return (1);
+    }
+    lp_measurement(out, POOL_MEASUREMENT);
+    lp_tag(out, "name", vi->pool_name);
+    lp_tag(out, "state", zpool_state_to_name((vdev_state_t) vs->vs_state,
+                                             (vdev_aux_t) vs->vs_aux));
+    lp_tags(out, vi->vdev_desc);
+    lp_field_uint(out, "alloc", MASK_UINT64(vs->vs_alloc));
+    lp_field_uint(out, "free", MASK_UINT64(vs->vs_space - vs->vs_alloc));
+    lp_field_uint(out, "size", MASK_UINT64(vs->vs_space));
+    lp_field_uint(out, "read_bytes",
+                  MASK_UINT64(vs->vs_bytes[ZIO_TYPE_READ]));
+    lp_field_uint(out, "read_errors", MASK_UINT64(vs->vs_read_errors));
+    lp_field_uint(out, "read_ops", MASK_UINT64(vs->vs_ops[ZIO_TYPE_READ]));
+    lp_field_uint(out, "write_bytes",
+                  MASK_UINT64(vs->vs_bytes[ZIO_TYPE_WRITE]));
+    lp_field_uint(out, "write_errors", MASK_UINT64(vs->vs_write_errors));
+    lp_field_uint(out, "write_ops",
+                  MASK_UINT64(vs->vs_ops[ZIO_TYPE_WRITE]));
+    lp_field_uint(out, "checksum_errors",
+                  MASK_UINT64(vs->vs_checksum_errors));
+    lp_field_uint(out, "fragmentation", MASK_UINT64(vs->vs_fragmentation));
+    lp_end(out, vi->timestamp);
+    return (0);
+}
+
+/*
+ * per-second rates of the vdev_stat_t counters, against the monotonic
+ * clock, so queries don't need non_negative_derivative()
+ *
+ * The first sample of a vdev only sets the baseline. A counter that went
+ * backwards was reset, by an import, a replace or `zpool clear`, and
+ * counts from zero.
+ */
+int
+print_vdev_rates(vdev_info_t *vi) {
+    lp_writer_t *out = vi->out;
+    vdev_cache_entry_t *ve = vi->ve;
+    uint_t c;
+    vdev_stat_t *vs;
+    double secs;
+    static const char *fields[] = {
+        "read_iops", "write_iops", "read_bps", "write_bps",
+        "read_errors_ps", "write_errors_ps", "checksum_errors_ps"
+    };
+    uint64_t cur[sizeof (fields) / sizeof (fields[0])];
+    uint_t n = sizeof (fields) / sizeof (fields[0]);
+    int first;
+
+    if (!print_rates || ve == NULL)
+        return (0);
+    if (nvlist_lookup_uint64_array(vi->nvroot,
+                                   ZPOOL_CONFIG_VDEV_STATS,
+                                   (uint64_t **) &vs, &c) != 0) {
+        return (1);
+    }
+    cur[0] = vs->vs_ops[ZIO_TYPE_READ];
+    cur[1] = vs->vs_ops[ZIO_TYPE_WRITE];
+    cur[2] = vs->vs_bytes[ZIO_TYPE_READ];
+    cur[3] = vs->vs_bytes[ZIO_TYPE_WRITE];
+    cur[4] = vs->vs_read_errors;
+    cur[5] = vs->vs_write_errors;
+    cur[6] = vs->vs_checksum_errors;
+
+    first = ve->rate_prev == NULL || ve->rate_when >= vi->hrtime;
+    if (ve->rate_prev == NULL) {
+        ve->rate_prev = safe_calloc(n, sizeof (uint64_t));
+        ve->rate_len = n;
+    }
+    if (!first) {
+        secs = (double) (vi->hrtime - ve->rate_when) / 1e9;
+        lp_measurement(out, POOL_RATES_MEASUREMENT);
+        lp_tag(out, "name", vi->pool_name);
+        lp_tags(out, vi->vdev_desc);
+        for (uint_t i = 0; i < n; i++) {
+            uint64_t d = cur[i] >= ve->rate_prev[i] ?
+                cur[i] - ve->rate_prev[i] : cur[i];
+
+            lp_field_fixed(out, fields[i], (double) d / secs, 2);
+        }
+        lp_end(out, vi->timestamp);
+    }
+    (void) memcpy(ve->rate_prev, cur, sizeof (cur));
+    ve->rate_when = vi->hrtime;
+    return (0);
+}
+
+/*
+ * the increments since the last sample, for values kept in a vdev's cache
+ * entry
+ *
+ * *prev is (re)allocated to hold the n current values for next time. If
+ * there was no previous sample, or any value went backwards because the
+ * counters were reset, for instance by an import, the increments are the
+ * current values. Returns non-zero if there was a previous sample, reset
+ * or not.
+ */
+int
+vdev_delta(uint64_t **prev, uint_t *prev_len, const uint64_t *cur,
+           uint64_t *delta, uint_t n) {
+    int had_prev = *prev != NULL && *prev_len == n;
+    int reset = !had_prev;
+
+    for (uint_t i = 0; !reset && i < n; i++) {
+        if (cur[i] < (*prev)[i])
+            reset = 1;
+    }
+    for (uint_t i = 0; i < n; i++)
+        delta[i] = reset ? cur[i] : cur[i] - (*prev)[i];
+
+    if (*prev_len != n) {
+        free(*prev);
+        *prev = safe_calloc(n, sizeof (uint64_t));
+        *prev_len = n;
+    }
+    (void) memcpy(*prev, cur, n * sizeof (uint64_t));
+    return (had_prev);
+}
+
+/*
+ * latency histogram bucket b counts I/Os of (2^(b-1), 2^b] nanoseconds,
+ * the last bucket counts everything longer
+ */
+static inline double
+lat_bucket_low(uint_t b) {
+    return (b == 0 ? 0.0 : (double) (1ULL << (b - 1)));
+}
+
+/*
+ * estimate the q quantile, interpolating linearly within the bucket where
+ * it falls
+ */
+uint64_t
+lat_quantile(const uint64_t *h, uint_t n, uint64_t total, double q) {
+    double rank = q * (double) total, low;
+    uint64_t seen = 0;
+
+    for (uint_t b = 0; b < n; b++) {
+        if (h[b] == 0 || (double) (seen + h[b]) < rank) {
+            seen += h[b];
+            continue;
+        }
+        low = lat_bucket_low(b);
+        return ((uint64_t) (low + (lat_bucket_low(b + 1) - low) *
+                            (rank - (double) seen) / (double) h[b]));
+    }
+    return ((uint64_t) lat_bucket_low(n));
+}
+
+/*
+ * one line per vdev with the quantiles and mean of each latency type, for
+ * the I/Os since the last sample. The mean takes each I/O to be in the
+ * middle of its bucket, ZFS doesn't keep the sum of the latencies.
+ */
+void
+print_latency_summary(vdev_info_t *vi, const char **names, uint_t ntypes,
+                      const uint64_t *delta, uint_t nbuckets) {
+    static const struct {
+        const char *suffix;
+        double q;
+    } quantiles[] = {
+        {"_p50", 0.50}, {"_p90", 0.90}, {"_p99", 0.99}, {"_p999", 0.999}
+    };
+    lp_writer_t *out = vi->out;
+    char field[64];
+    const uint64_t *h;
+    uint64_t total;
+    double sum;
+    int started = 0;
+
+    for (uint_t i = 0; i < ntypes; i++) {
+        /* left out by --select */
+        if (names[i] == NULL)
+            continue;
+        h = delta + i * nbuckets;
+        total = 0;
+        sum = 0;
+        for (uint_t b = 0; b < nbuckets; b++) {
+            total += h[b];
+            sum += (double) h[b] *
+                   (lat_bucket_low(b) + lat_bucket_low(b + 1)) / 2;
+        }
+        /* nothing to summarize for an idle type */
+        if (total == 0)
+            continue;
+        if (!started) {
+            lp_measurement(out, POOL_LATENCY_SUMMARY_MEASUREMENT);
+            lp_tag(out, "name", vi->pool_name);
+            lp_tags(out, vi->vdev_desc);
+            started = 1;
+        }
+        for (uint_t j = 0; j < sizeof (quantiles) / sizeof (quantiles[0]);
+             j++) {
+            (void) snprintf(field, sizeof (field), "%s%s", names[i],
+                            quantiles[j].suffix);
+            lp_field_uint(out, field,
+                          lat_quantile(h, nbuckets, total, quantiles[j].q));
+        }
+        (void) snprintf(field, sizeof (field), "%s_mean", names[i]);
+        lp_field_uint(out, field, (uint64_t) (sum / (double) total));
+    }
+    if (started)
+        lp_end(out, vi->timestamp);
+}
+
+/*
+ * The histograms and queues in ZPOOL_CONFIG_VDEV_STATS_EX that are
+ * printed. --select clears the "print" bits of the ones that aren't
+ * wanted and select_compile() packs the rest together, so nothing else
+ * is looked up or formatted.
+ */
+#define SELECT_FIELD        0x1 /* in its own measurement */
+#define SELECT_SUMMARY      0x2 /* a latency in zpool_latency_summary */
+#define SELECT_LATENCY      (SELECT_FIELD | SELECT_SUMMARY)
+
+typedef struct stat_field {
+    const char *name;           /* in ZPOOL_CONFIG_VDEV_STATS_EX */
+    const char *short_name;     /* the field name, influxdb-ready */
+    uint_t print;               /* SELECT_* */
+    uint_t slot;                /* in stats_ex_t, set by stats_ex_init() */
+} stat_field_t;
+
+stat_field_t lat_fields[] = {
+    {ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO,   "total_read", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO,   "total_write", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO,  "disk_read", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO,  "disk_write", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,  "sync_read", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,  "sync_write", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO, "async_read", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO, "async_write", SELECT_LATENCY, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_LAT_HISTO,   "scrub", SELECT_LATENCY, 0},
+#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
+    {ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO,    "trim", SELECT_LATENCY, 0},
+#endif
+    {0}
+};
+
+stat_field_t size_fields[] = {
+    {ZPOOL_CONFIG_VDEV_SYNC_IND_R_HISTO,  "sync_read_ind", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_IND_W_HISTO,  "sync_write_ind", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_IND_R_HISTO, "async_read_ind", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_IND_W_HISTO, "async_write_ind", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_IND_SCRUB_HISTO,   "scrub_read_ind", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_AGG_R_HISTO,  "sync_read_agg", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_AGG_W_HISTO,  "sync_write_agg", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_AGG_R_HISTO, "async_read_agg", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_AGG_W_HISTO, "async_write_agg", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_AGG_SCRUB_HISTO,   "scrub_read_agg", SELECT_FIELD, 0},
+#ifdef ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO
+    {ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO,    "trim_write_ind", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_AGG_TRIM_HISTO,    "trim_write_agg", SELECT_FIELD, 0},
+#endif
+    {0}
+};
+
+stat_field_t queue_fields[] = {
+    {ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,  "sync_r_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,  "sync_w_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,   "async_scrub_active",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,    "sync_r_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,    "sync_w_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,   "async_r_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,   "async_w_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,     "async_scrub_pend",
+     SELECT_FIELD, 0},
+    {0}
+};
+
+/* the same queues for the pool, in zpool_vdev_stats */
+stat_field_t pool_queue_fields[] = {
+    {ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,  "sync_r_active_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,  "sync_w_active_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,   "async_scrub_active_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,    "sync_r_pend_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,    "sync_w_pend_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,   "async_r_pend_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,   "async_w_pend_queue",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,     "async_scrub_pend_queue",
+     SELECT_FIELD, 0},
+    {0}
+};
+
+/* and for --queue-sample and --shm, which --select doesn't apply to */
+stat_field_t queue_depth_fields[] = {
+    {ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,  "sync_r_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,  "sync_w_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,   "async_scrub_active",
+     SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,    "sync_r_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,    "sync_w_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,   "async_r_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,   "async_w_pend", SELECT_FIELD, 0},
+    {ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,     "async_scrub_pend",
+     SELECT_FIELD, 0},
+    {0}
+};
+
+#define QUEUE_DEPTH_FIELDS \
+    (sizeof (queue_depth_fields) / sizeof (queue_depth_fields[0]) - 1)
+
+/*
+ * ZPOOL_CONFIG_VDEV_STATS_EX is decoded with one pass over its nvpairs per
+ * vdev, rather than a lookup per field that scans the nvlist from the
+ * start each time. Each name in the field tables has a slot in a
+ * stats_ex_t. The slots are found through a hash table that is grown at
+ * startup until every name has a bucket to itself, so finding one is a
+ * hash and a strcmp(). Names that aren't in the tables, or were left out
+ * by --select, are skipped.
+ */
+#define STATS_EX_SLOTS      64
+
+typedef struct stats_ex {
+    uint64_t *array[STATS_EX_SLOTS];    /* histograms, NULL if missing */
+    uint_t len[STATS_EX_SLOTS];
+    uint64_t value[STATS_EX_SLOTS];     /* queues */
+    uint8_t have[STATS_EX_SLOTS];       /* value was found */
+} stats_ex_t;
+
+typedef struct stats_ex_name {
+    const char *name;           /* NULL = empty bucket */
+    uint_t slot;
+} stats_ex_name_t;
+
+stats_ex_name_t *stats_ex_names;
+uint_t stats_ex_mask;           /* buckets - 1 */
+uint_t stats_ex_nslots;
+
+uint_t
+stats_ex_hash(const char *name) {
+    uint32_t h = 2166136261U;   /* FNV-1a */
+
+    while (*name != '\0')
+        h = (h ^ (uint8_t) *name++) * 16777619U;
+    return (h);
+}
+
+int
+stats_ex_slot(const char *name) {
+    uint_t i = stats_ex_hash(name) & stats_ex_mask;
+
+    for (; stats_ex_names[i].name != NULL; i = (i + 1) & stats_ex_mask) {
+        if (strcmp(stats_ex_names[i].name, name) == 0)
+            return ((int) stats_ex_names[i].slot);
+    }
+    return (-1);
+}
+
+/*
+ * give every field a slot and build the hash table, after --select
+ */
+void
+stats_ex_init(void) {
+    stat_field_t *tables[] = {
+        lat_fields, size_fields, queue_fields, pool_queue_fields,
+        queue_depth_fields, NULL
+    };
+    const char *names[STATS_EX_SLOTS];
+    uint_t size = 16, i, collided;
+    int slot;
+
+    stats_ex_nslots = 0;
+    for (int t = 0; tables[t] != NULL; t++) {
+        for (stat_field_t *f = tables[t]; f->name != NULL; f++) {
+            /* the queues are in more than one table */
+            for (slot = 0; slot < (int) stats_ex_nslots; slot++) {
+                if (strcmp(names[slot], f->name) == 0)
+                    break;
+            }
+            if (slot == (int) stats_ex_nslots)
+                names[stats_ex_nslots++] = f->name;
+            f->slot = (uint_t) slot;
+        }
+    }
+
+    /* big enough for no collisions, any left are probed past */
+    while (size < 2 * stats_ex_nslots)
+        size *= 2;
+    for (;;) {
+        free(stats_ex_names);
+        stats_ex_names = safe_calloc(size, sizeof (stats_ex_name_t));
+        stats_ex_mask = size - 1;
+        collided = 0;
+        for (slot = 0; slot < (int) stats_ex_nslots; slot++) {
+            i = stats_ex_hash(names[slot]) & stats_ex_mask;
+            for (; stats_ex_names[i].name != NULL;
+                 i = (i + 1) & stats_ex_mask)
+                collided = 1;
+            stats_ex_names[i].name = names[slot];
+            stats_ex_names[i].slot = (uint_t) slot;
+        }
+        if (!collided || size >= 65536)
+            break;
+        size *= 2;
+    }
+}
+
+void
+stats_ex_decode(nvlist_t *nv_ex, stats_ex_t *sx) {
+    nvpair_t *nvp = NULL;
+    int slot;
+
+    for (uint_t i = 0; i < stats_ex_nslots; i++) {
+        sx->array[i] = NULL;
+        sx->have[i] = 0;
+    }
+    while ((nvp = nvlist_next_nvpair(nv_ex, nvp)) != NULL) {
+        if ((slot = stats_ex_slot(nvpair_name(nvp))) < 0)
+            continue;
+        if (nvpair_type(nvp) == DATA_TYPE_UINT64_ARRAY) {
+            (void) nvpair_value_uint64_array(nvp, &sx->array[slot],
+                                             &sx->len[slot]);
+        } else if (nvpair_value_uint64(nvp, &sx->value[slot]) == 0) {
+            sx->have[slot] = 1;
+        }
+    }
+}
+
+/*
+ * the vdev's decoded stats, NULL if it has none
+ */
+stats_ex_t *
+vdev_stats_ex(vdev_info_t *vi) {
+    if (vi->nv_ex == NULL)
+        return (NULL);
+    if (!vi->sx_decoded) {
+        stats_ex_decode(vi->nv_ex, vi->sx);
+        vi->sx_decoded = 1;
+    }
+    return (vi->sx);
+}
+
+typedef struct histo_type {
+    const char *name;
+    const char *short_name;
+    uint64_t sum;
+    uint64_t *array;
+} histo_type_t;
+
+/*
+ * look up the histograms of the fields, returning the index of the last
+ * bucket in *end
+ */
+int
+histo_lookup(stats_ex_t *sx, const stat_field_t *fields, histo_type_t *types,
+             uint_t *end) {
+    uint_t c, i;
+
+    for (i = 0; fields[i].name; i++) {
+        types[i].name = fields[i].name;
+        types[i].short_name = fields[i].short_name;
+        types[i].sum = 0;
+        if ((types[i].array = sx->array[fields[i].slot]) == NULL) {
+            fprintf(stderr, "error: can't get %s\n", fields[i].name);
+            return (3);
+        }
+        c = sx->len[fields[i].slot];
+        if (c == 0 || c > MAX_HISTO_BUCKETS) {
+            fprintf(stderr, "error: unexpected size for %s\n",
+                    fields[i].name);
+            return (3);
+        }
+        /* end count count, all of the arrays are the same size */
+        *end = c - 1;
+    }
+    types[i].name = NULL;
+    return (0);
+}
+
+/*
+ * print the buckets of a set of histograms, one line per printed bucket
+ * with a field per type
+ *
+ * Bucket b counts the values up to 2^b, the last one (end) everything
+ * else. Only the buckets from range->min to range->max, every
+ * range->step of them, are printed, each with the counts of the buckets
+ * merged into it since the last one printed. The buckets below min go
+ * into min and the ones above max go into "+Inf". With
+ * --sum-histogram-buckets each printed bucket also includes all of the
+ * ones before it.
+ */
+void
+print_histogram_buckets(vdev_info_t *vi, const char *measurement,
+                        char le[][24], const histo_range_t *range,
+                        histo_type_t *types, uint_t end) {
+    lp_writer_t *out = vi->out;
+    int changed = 0;
+
+    for (uint_t bucket = 0; bucket <= end; bucket++) {
+        for (int i = 0; types[i].name; i++) {
+            types[i].sum += types[i].array[bucket];
+            changed |= types[i].array[bucket] != 0;
+        }
+        if (bucket < end && (bucket < range->min || bucket > range->max ||
+                             (bucket - range->min) % range->step != 0))
+            continue;
+        /* in delta mode, buckets that didn't change are left out */
+        if (!histogram_deltas || changed) {
+            lp_measurement(out, measurement);
+            /* OTLP needs the index of the last one, as for the others */
+            lp_tag(out, "le", bucket < end || net_out.proto == OUTPUT_OTLP ?
+                   le[bucket] : "+Inf");
+            lp_tag(out, "name", vi->pool_name);
+            lp_tags(out, vi->vdev_desc);
+            for (int i = 0; types[i].name; i++)
+                lp_field_uint(out, types[i].short_name, types[i].sum);
+            lp_end(out, vi->timestamp);
+        }
+        changed = 0;
+        for (int i = 0; !sum_histogram_buckets && types[i].name; i++)
+            types[i].sum = 0;
+    }
+}
+
+/*
+ * vdev latency stats are histograms stored as nvlist arrays of uint64.
+ * Latency stats include the ZIO scheduler classes plus lower-level
+ * vdev latencies.
+ *
+ * In many cases, the top-level "root" view obscures the underlying
+ * top-level vdev operations. For example, if a pool has a log, special,
+ * or cache device, then each can behave very differently. It is useful
+ * to see how each is responding.
+ */
+int
+print_vdev_latency_stats(vdev_info_t *vi) {
+    uint_t end = 0, n = 0;
+    uint64_t cur[LAT_TYPES_MAX * MAX_HISTO_BUCKETS];
+    uint64_t delta[LAT_TYPES_MAX * MAX_HISTO_BUCKETS];
+    int print_buckets = !no_histograms && !no_latency_buckets;
+    histo_type_t lat_type[LAT_TYPES_MAX + 1];
+    histo_type_t bucket_type[LAT_TYPES_MAX + 1];
+    stats_ex_t *sx;
+    int err;
+
+    if ((sx = vdev_stats_ex(vi)) == NULL) {
+        return (6);
+    }
+    if ((err = histo_lookup(sx, lat_fields, lat_type, &end)) != 0)
+        return (err);
+
+    if ((latency_summary || (histogram_deltas && print_buckets)) &&
+        vi->ve != NULL) {
+        const char *names[LAT_TYPES_MAX];
+        uint_t ntypes = 0;
+        int had_prev;
+
+        for (; lat_type[ntypes].name; ntypes++) {
+            /* NULL for the ones only printed as buckets */
+            names[ntypes] = lat_fields[ntypes].print & SELECT_SUMMARY ?
+                lat_type[ntypes].short_name : NULL;
+            (void) memcpy(cur + ntypes * (end + 1), lat_type[ntypes].array,
+                          (end + 1) * sizeof (uint64_t));
+        }
+        had_prev = vdev_delta(&vi->ve->lat_prev, &vi->ve->lat_len, cur,
+                              delta, ntypes * (end + 1));
+        if (latency_summary)
+            print_latency_summary(vi, names, ntypes, delta, end + 1);
+        /* the first sample is only the baseline for the deltas */
+        if (histogram_deltas && !had_prev)
+            return (0);
+        for (int i = 0; histogram_deltas && lat_type[i].name; i++)
+            lat_type[i].array = delta + i * (end + 1);
+    } else if (histogram_deltas) {
+        return (0);
+    }
+    if (!print_buckets)
+        return (0);
+
+    /* leaving out the ones only wanted for the summary */
+    for (int i = 0; lat_type[i].name; i++) {
+        if (lat_fields[i].print & SELECT_FIELD)
+            bucket_type[n++] = lat_type[i];
+    }
+    bucket_type[n].name = NULL;
+    print_histogram_buckets(vi, POOL_LATENCY_MEASUREMENT, lat_le, &lat_range,
+                            bucket_type, end);
+    return (0);
+}
+
+/*
+ * vdev request size stats are histograms stored as nvlist arrays of uint64.
+ * Request size stats include the ZIO scheduler classes plus lower-level
+ * vdev sizes. Both independent (ind) and aggregated (agg) sizes are reported.
+ *
+ * In many cases, the top-level "root" view obscures the underlying
+ * top-level vdev operations. For example, if a pool has a log, special,
+ * or cache device, then each can behave very differently. It is useful
+ * to see how each is responding.
+ */
+int
+print_vdev_size_stats(vdev_info_t *vi) {
+    uint_t end = 0;
+    uint64_t delta[SIZE_TYPES_MAX * MAX_HISTO_BUCKETS];
+    histo_type_t size_type[SIZE_TYPES_MAX + 1];
+    stats_ex_t *sx;
+    int err;
+
+    if ((sx = vdev_stats_ex(vi)) == NULL) {
+        return (6);
+    }
+    if ((err = histo_lookup(sx, size_fields, size_type, &end)) != 0)
+        return (err);
+
+    if (histogram_deltas) {
+        uint64_t cur[SIZE_TYPES_MAX * MAX_HISTO_BUCKETS];
+        uint_t ntypes = 0;
+
+        if (vi->ve == NULL)
+            return (0);
+        for (; size_type[ntypes].name; ntypes++) {
+            (void) memcpy(cur + ntypes * (end + 1), size_type[ntypes].array,
+                          (end + 1) * sizeof (uint64_t));
+        }
+        /* the first sample is only the baseline for the deltas */
+        if (!vdev_delta(&vi->ve->size_prev, &vi->ve->size_len, cur, delta,
+                        ntypes * (end + 1)))
+            return (0);
+        for (int i = 0; size_type[i].name; i++)
+            size_type[i].array = delta + i * (end + 1);
+    }
+
+    print_histogram_buckets(vi, POOL_IO_SIZE_MEASUREMENT, size_le,
+                            &size_range, size_type, end);
+    return (0);
+}
+
+/*
+ * ZIO scheduler queue stats are stored as gauges. This is unfortunate
+ * because the values can change very rapidly and any point-in-time
+ * value will quickly be obsoleted. It is also not easy to downsample.
+ * Thus only the top-level queue stats might be beneficial... maybe.
+ */
+int
+print_queue_stats(vdev_info_t *vi) {
+    lp_writer_t *out = vi->out;
+    stats_ex_t *sx;
+    uint_t slot;
+    size_t mark = out->len;
+
+    if ((sx = vdev_stats_ex(vi)) == NULL) {
+        return (6);
+    }
+
+    lp_measurement(out, POOL_QUEUE_MEASUREMENT);
+    lp_tag(out, "name", vi->pool_name);
+    lp_tags(out, vi->vdev_desc);
+    for (int i = 0; queue_fields[i].name; i++) {
+        slot = queue_fields[i].slot;
+        if (!sx->have[slot]) {
+            fprintf(stderr, "error: can't get %s\n",
+                    queue_fields[i].name);
+            /* throw away the partial line */
+            out->len = mark;
+            return (3);
+        }
+        lp_field_uint(out, queue_fields[i].short_name, sx->value[slot]);
+    }
+    lp_end(out, vi->timestamp);
+    return (0);
+}
+
+/*
+ * top-level vdev stats are at the pool level
+ */
+int
+print_top_level_vdev_stats(vdev_info_t *vi) {
+	lp_writer_t *out = vi->out;
+	stats_ex_t *sx;
+	uint_t slot;
+	size_t mark = out->len;
+
+	if ((sx = vdev_stats_ex(vi)) == NULL) {
+		return (6);
+	}
+
+	lp_measurement(out, VDEV_MEASUREMENT);
+	lp_tag(out, "name", vi->pool_name);
+	lp_tag(out, "vdev", "root");
+	for (int i = 0; pool_queue_fields[i].name; i++) {
+		slot = pool_queue_fields[i].slot;
+		if (!sx->have[slot]) {
+			fprintf(stderr, "error: can't get %s\n",
+			    pool_queue_fields[i].name);
+			/* throw away the partial line */
+			out->len = mark;
+			return (3);
+		}
+		lp_field_uint(out, pool_queue_fields[i].short_name,
+		    MASK_UINT64(sx->value[slot]));
+	}
+
+	lp_end(out, vi->timestamp);
+	return (0);
+}
+
+/*
+ * --classes: as the comment on print_vdev_latency_stats() says, log,
+ * special and cache devices behave very differently from the rest of the
+ * pool, but they only show up as vdevs among all the others. So at the
+ * root, the top-level vdevs are summed by their allocation class, along
+ * with the l2cache and spares arrays, which aren't in the tree, and a set
+ * of lines is printed per class that the pool has. The summed histograms
+ * go by the same options as the vdevs' ones.
+ */
+const char *class_names[CLASS_MAX] = {
+    "normal", "log", "special", "dedup", "cache", "spare"
+};
+
+/*
+ * sum one histogram set of a vdev into the class's, if it has one, in the
+ * order of fields, which are the ones printed
+ */
+void
+class_add_histograms(stats_ex_t *sx, const stat_field_t *fields,
+                     uint64_t *sum, uint_t *sum_end) {
+    histo_type_t types[SIZE_TYPES_MAX + 1];
+    uint_t end = 0, n = 0;
+
+    if (fields[0].name == NULL || histo_lookup(sx, fields, types, &end) != 0)
+        return;
+    /*
+     * the arrays are the same size for all vdevs, but not to be trusted;
+     * the first vdev that has them sets it
+     */
+    if (*sum_end != 0 && end != *sum_end)
+        return;
+    for (int i = 0; types[i].name; i++) {
+        for (uint_t b = 0; b <= end; b++)
+            sum[n++] += types[i].array[b];
+    }
+    *sum_end = end;
+}
+
+void
+class_add(class_sum_t *cs, nvlist_t *nv, const stat_field_t *lat_buckets) {
+    vdev_stat_t *vs;
+    nvlist_t *nv_ex;
+    stats_ex_t sx;
+    uint_t c;
+
+    if (nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
+                                   (uint64_t **) &vs, &c) != 0)
+        return;
+    cs->stats[0] += vs->vs_alloc;
+    cs->stats[1] += vs->vs_space;
+    cs->stats[2] += vs->vs_bytes[ZIO_TYPE_READ];
+    cs->stats[3] += vs->vs_read_errors;
+    cs->stats[4] += vs->vs_ops[ZIO_TYPE_READ];
+    cs->stats[5] += vs->vs_bytes[ZIO_TYPE_WRITE];
+    cs->stats[6] += vs->vs_write_errors;
+    cs->stats[7] += vs->vs_ops[ZIO_TYPE_WRITE];
+    cs->stats[8] += vs->vs_checksum_errors;
+    /* the vdevs without metaslabs have none */
+    if (vs->vs_fragmentation <= 100) {
+        cs->stats[9] += vs->vs_fragmentation * vs->vs_space;
+        cs->stats[10] += vs->vs_space;
+    }
+    if (!no_histograms &&
+        nvlist_lookup_nvlist(nv, ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) == 0) {
+        stats_ex_decode(nv_ex, &sx);
+        if (!no_latency_buckets)
+            class_add_histograms(&sx, lat_buckets, cs->lat, &cs->lat_end);
+        class_add_histograms(&sx, size_fields, cs->size, &cs->size_end);
+    }
+    cs->vdevs++;
+}
+
+/*
+ * print a class's summed histograms like print_histogram_buckets() does a
+ * vdev's
+ */
+void
+print_class_histograms(vdev_info_t *vi, const char *measurement,
+                       char le[][24], const histo_range_t *range,
+                       const stat_field_t *fields, uint64_t *sum,
+                       uint_t end, uint64_t **prev, uint_t *prev_len) {
+    uint64_t delta[SIZE_TYPES_MAX * MAX_HISTO_BUCKETS];
+    histo_type_t types[SIZE_TYPES_MAX + 1];
+    uint_t ntypes = 0;
+
+    if (end == 0)
+        return;
+    for (; fields[ntypes].name; ntypes++) {
+        types[ntypes].name = fields[ntypes].name;
+        types[ntypes].short_name = fields[ntypes].short_name;
+        types[ntypes].sum = 0;
+        types[ntypes].array = sum + ntypes * (end + 1);
+    }
+    types[ntypes].name = NULL;
+    if (histogram_deltas) {
+        /* the first sample is only the baseline for the deltas */
+        if (!vdev_delta(prev, prev_len, sum, delta, ntypes * (end + 1)))
+            return;
+        for (uint_t i = 0; i < ntypes; i++)
+            types[i].array = delta + i * (end + 1);
+    }
+    print_histogram_buckets(vi, measurement, le, range, types, end);
+}
+
+int
+print_class_stats(vdev_info_t *vi) {
+    lp_writer_t *out = vi->out;
+    pool_cache_t *pc = vi->pc;
+    stat_field_t lat_buckets[LAT_TYPES_MAX + 1];
+    nvlist_t **child;
+    uint_t children, c, n = 0;
+    class_sum_t *cs;
+    vdev_info_t cvi;
+    char desc[32];
+    uint64_t value;
+    char *s;
+    int cl;
+
+    if (!class_stats)
+        return (0);
+    if (pc->classes == NULL)
+        pc->classes = safe_calloc(CLASS_MAX, sizeof (class_sum_t));
+    for (cl = 0; cl < CLASS_MAX; cl++) {
+        cs = &pc->classes[cl];
+        cs->vdevs = 0;
+        cs->lat_end = 0;
+        cs->size_end = 0;
+        (void) memset(cs->stats, 0, sizeof (cs->stats));
+        (void) memset(cs->lat, 0, sizeof (cs->lat));
+        (void) memset(cs->size, 0, sizeof (cs->size));
+    }
+    /* those only printed for --latency-summary aren't buckets */
+    for (int i = 0; lat_fields[i].name; i++) {
+        if (lat_fields[i].print & SELECT_FIELD)
+            lat_buckets[n++] = lat_fields[i];
+    }
+    lat_buckets[n].name = NULL;
+    lat_buckets[n].short_name = NULL;
+
+    if (nvlist_lookup_nvlist_array(vi->nvroot, ZPOOL_CONFIG_CHILDREN,
+                                   &child, &children) != 0)
+        children = 0;
+    for (c = 0; c < children; c++) {
+        if (nvlist_lookup_string(child[c], ZPOOL_CONFIG_TYPE, &s) == 0 &&
+            (strcmp(s, VDEV_TYPE_HOLE) == 0 ||
+             strcmp(s, VDEV_TYPE_INDIRECT) == 0))
+            continue;
+        cl = CLASS_NORMAL;
+        if (nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
+                                 &value) == 0 && value != 0) {
+            cl = CLASS_LOG;
+        } else if (nvlist_lookup_string(child[c],
+                                        ZPOOL_CONFIG_ALLOCATION_BIAS,
+                                        &s) == 0) {
+            if (strcmp(s, VDEV_ALLOC_BIAS_LOG) == 0)
+                cl = CLASS_LOG;
+            else if (strcmp(s, VDEV_ALLOC_BIAS_SPECIAL) == 0)
+                cl = CLASS_SPECIAL;
+            else if (strcmp(s, VDEV_ALLOC_BIAS_DEDUP) == 0)
+                cl = CLASS_DEDUP;
+        }
+        class_add(&pc->classes[cl], child[c], lat_buckets);
+    }
+    if (nvlist_lookup_nvlist_array(vi->nvroot, ZPOOL_CONFIG_L2CACHE,
+                                   &child, &children) == 0) {
+        for (c = 0; c < children; c++)
+            class_add(&pc->classes[CLASS_CACHE], child[c], lat_buckets);
+    }
+    if (nvlist_lookup_nvlist_array(vi->nvroot, ZPOOL_CONFIG_SPARES,
+                                   &child, &children) == 0) {
+        for (c = 0; c < children; c++)
+            class_add(&pc->classes[CLASS_SPARE], child[c], lat_buckets);
+    }
+
+    cvi = *vi;
+    cvi.vdev_desc = desc;
+    for (cl = 0; cl < CLASS_MAX; cl++) {
+        cs = &pc->classes[cl];
+        if (cs->vdevs == 0)
+            continue;
+        (void) snprintf(desc, sizeof (desc), "class=%s", class_names[cl]);
+        lp_measurement(out, CLASS_MEASUREMENT);
+        lp_tag(out, "name", vi->pool_name);
+        lp_tags(out, desc);
+        lp_field_uint(out, "vdevs", cs->vdevs);
+        lp_field_uint(out, "alloc", MASK_UINT64(cs->stats[0]));
+        lp_field_uint(out, "free", MASK_UINT64(cs->stats[1] - cs->stats[0]));
+        lp_field_uint(out, "size", MASK_UINT64(cs->stats[1]));
+        lp_field_uint(out, "read_bytes", MASK_UINT64(cs->stats[2]));
+        lp_field_uint(out, "read_errors", MASK_UINT64(cs->stats[3]));
+        lp_field_uint(out, "read_ops", MASK_UINT64(cs->stats[4]));
+        lp_field_uint(out, "write_bytes", MASK_UINT64(cs->stats[5]));
+        lp_field_uint(out, "write_errors", MASK_UINT64(cs->stats[6]));
+        lp_field_uint(out, "write_ops", MASK_UINT64(cs->stats[7]));
+        lp_field_uint(out, "checksum_errors", MASK_UINT64(cs->stats[8]));
+        /* weighted by size, as the pool's own is */
+        if (cs->stats[10] != 0)
+            lp_field_uint(out, "fragmentation",
+                          MASK_UINT64(cs->stats[9] / cs->stats[10]));
+        lp_end(out, vi->timestamp);
+
+        print_class_histograms(&cvi, CLASS_LATENCY_MEASUREMENT, lat_le,
+                               &lat_range, lat_buckets, cs->lat,
+                               cs->lat_end, &cs->lat_prev, &cs->lat_len);
+        print_class_histograms(&cvi, CLASS_IO_SIZE_MEASUREMENT, size_le,
+                               &size_range, size_fields, cs->size,
+                               cs->size_end, &cs->size_prev, &cs->size_len);
+    }
+    return (0);
+}
+
+/*
+ * --guid-tags: what the vdev_guid tag stands for, printed once for each
+ * vdev cache entry, so at startup and whenever the entry is rebuilt
+ * because the pool config changed, the vdev moved or its path changed,
+ * or in every sample with --listen. The names are tags so they can be
+ * joined on, but as they only come with a change they don't add series to
+ * the other measurements.
+ */
+int
+print_vdev_info(vdev_info_t *vi) {
+    lp_writer_t *out = vi->out;
+    vdev_cache_entry_t *ve = vi->ve;
+    char vdev_desc[VDEV_DESC_LEN];
+    char guid[24];
+    char *vdev_type, *s;
+
+    /* --listen serves only the last sample, so it needs them in each one */
+    if (!guid_tags || ve == NULL ||
+        (ve->info_printed && net_out.proto != OUTPUT_PROM))
+        return (0);
+    if (nvlist_lookup_string(vi->nvroot, ZPOOL_CONFIG_TYPE,
+                             &vdev_type) != 0) {
+        vdev_type = "unknown";
+    }
+    lp_measurement(out, VDEV_INFO_MEASUREMENT);
+    lp_tag(out, "name", vi->pool_name);
+    lp_tags(out, ve->vdev_desc);
+    lp_tags(out, get_vdev_desc(vi->nvroot, vi->parent_name, vdev_desc,
+                               sizeof (vdev_desc), 1));
+    s = escape_string(vdev_type);
+    lp_tag(out, "type", s);
+    free(s);
+    /* GUIDs don't fit the masked integers, so they are tags */
+    if (ve->parent_guid != 0) {
+        (void) snprintf(guid, sizeof (guid), "%lu", ve->parent_guid);
+        lp_tag(out, "parent_guid", guid);
+    }
+    lp_field_uint(out, "depth", (uint64_t) vi->depth);
+    if (ve->vdev_id != UINT64_MAX)
+        lp_field_uint(out, "id", ve->vdev_id);
+    lp_end(out, vi->timestamp);
+    ve->info_printed = 1;
+    return (0);
+}
+
+/*
+ * --shm: rather than printing, keep the vdev's stats for the snapshot
+ * published by shm_publish() once all of the pools are sampled. The vdevs
+ * are those printed, so --max-depth and --top-leaves apply.
+ */
+int
+print_shm_vdev(vdev_info_t *vi) {
+    pool_cache_t *pc = vi->pc;
+    char vdev_name[VDEV_NAME_LEN];
+    zpi_shm_vdev_t *sv;
+    vdev_stat_t *vs;
+    stats_ex_t *sx;
+    char *path;
+    uint_t c, i;
+
+    if (shm_path == NULL)
+        return (0);
+    if (nvlist_lookup_uint64_array(vi->nvroot, ZPOOL_CONFIG_VDEV_STATS,
+                                   (uint64_t **) &vs, &c) != 0)
+        return (1);
+    if (pc->shm_n == pc->shm_size) {
+        pc->shm_size = pc->shm_size ? pc->shm_size * 2 : 16;
+        pc->shm_vdevs = safe_realloc(pc->shm_vdevs,
+                                     pc->shm_size * sizeof (zpi_shm_vdev_t));
+    }
+    sv = &pc->shm_vdevs[pc->shm_n++];
+    (void) memset(sv, 0, sizeof (*sv));
+    (void) snprintf(sv->pool, sizeof (sv->pool), "%s", pc->name);
+    (void) snprintf(sv->vdev, sizeof (sv->vdev), "%s", vi->ve != NULL ?
+                    vi->ve->vdev_name : get_vdev_name(vi->nvroot,
+                    vi->parent_name, vdev_name, sizeof (vdev_name)));
+    if (nvlist_lookup_string(vi->nvroot, ZPOOL_CONFIG_PATH, &path) == 0)
+        (void) snprintf(sv->path, sizeof (sv->path), "%s", path);
+    (void) nvlist_lookup_uint64(vi->nvroot, ZPOOL_CONFIG_GUID, &sv->guid);
+    sv->timestamp = vi->timestamp;
+    sv->depth = (uint32_t) vi->depth;
+    sv->state = (uint32_t) vs->vs_state;
+    sv->aux = (uint32_t) vs->vs_aux;
+    sv->alloc = vs->vs_alloc;
+    sv->size = vs->vs_space;
+    sv->read_ops = vs->vs_ops[ZIO_TYPE_READ];
+    sv->write_ops = vs->vs_ops[ZIO_TYPE_WRITE];
+    sv->read_bytes = vs->vs_bytes[ZIO_TYPE_READ];
+    sv->write_bytes = vs->vs_bytes[ZIO_TYPE_WRITE];
+    sv->read_errors = vs->vs_read_errors;
+    sv->write_errors = vs->vs_write_errors;
+    sv->checksum_errors = vs->vs_checksum_errors;
+    sv->fragmentation = vs->vs_fragmentation;
+
+    /* the active queues, then the pending ones, as in zpi_shm_vdev_t */
+    if ((sx = vdev_stats_ex(vi)) == NULL)
+        return (0);
+    for (i = 0; i < QUEUE_DEPTH_FIELDS; i++) {
+        if (!sx->have[queue_depth_fields[i].slot])
+            return (0);
+    }
+    for (i = 0; i < ZPI_SHM_QUEUES; i++) {
+        sv->active_queue[i] = sx->value[queue_depth_fields[i].slot];
+        sv->pend_queue[i] =
+            sx->value[queue_depth_fields[i + ZPI_SHM_QUEUES].slot];
+    }
+    sv->has_queues = 1;
+    return (0);
+}
+
+/*
+ * --queue-sample: as the comment on print_queue_stats() says, a queue
+ * depth read once per interval says little. So between the interval's
+ * samples the pool's stats are refreshed at a few Hz and the root vdev's
+ * queue depths, and only the root's, are kept in a window in the pool's
+ * cache. Each interval sample prints their min, max, mean and p99 over
+ * the window in zpool_queue_depth, and sample_pools() starts a new one.
+ */
+int
+queue_window_add(pool_cache_t *pc, nvlist_t *nvroot) {
+    nvlist_t *nv_ex;
+    stats_ex_t sx;
+    uint64_t *row;
+    uint_t slot;
+
+    if (nvlist_lookup_nvlist(nvroot, ZPOOL_CONFIG_VDEV_STATS_EX,
+                             &nv_ex) != 0)
+        return (6);
+    stats_ex_decode(nv_ex, &sx);
+    for (uint_t i = 0; i < QUEUE_DEPTH_FIELDS; i++) {
+        if (!sx.have[queue_depth_fields[i].slot])
+            return (3);
+    }
+
+    if (pc->queue_rows == pc->queue_size) {
+        pc->queue_size = pc->queue_size ? pc->queue_size * 2 : 128;
+        pc->queue_window = safe_realloc(pc->queue_window, pc->queue_size *
+                                        QUEUE_DEPTH_FIELDS * sizeof (uint64_t));
+        pc->queue_sorted = safe_realloc(pc->queue_sorted,
+                                        pc->queue_size * sizeof (uint64_t));
+    }
+    row = pc->queue_window + (size_t) pc->queue_rows * QUEUE_DEPTH_FIELDS;
+    for (uint_t i = 0; i < QUEUE_DEPTH_FIELDS; i++) {
+        slot = queue_depth_fields[i].slot;
+        row[i] = sx.value[slot];
+    }
+    pc->queue_rows++;
+    return (0);
+}
+
+int
+uint64_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/*
+ * the interval's own sample goes in the window, too
+ */
+int
+print_queue_depth(pool_sample_t *sample, nvlist_t *nvroot) {
+    pool_cache_t *pc = sample->pc;
+    lp_writer_t *out = sample->out;
+    const char *name;
+    uint64_t *v, sum;
+    uint_t n, i, r;
+    char key[64];
+    int err;
+
+    if ((err = queue_window_add(pc, nvroot)) != 0) {
+        if (err == 3)
+            fprintf(stderr, "error: can't get the queue depths\n");
+        return (err);
+    }
+
+    /* which may have moved the scratch space */
+    v = pc->queue_sorted;
+    n = pc->queue_rows;
+    lp_measurement(out, QUEUE_DEPTH_MEASUREMENT);
+    lp_tag(out, "name", pc->escaped_name);
+    lp_tag(out, "vdev", "root");
+    for (i = 0; i < QUEUE_DEPTH_FIELDS; i++) {
+        name = queue_depth_fields[i].short_name;
+        sum = 0;
+        for (r = 0; r < n; r++) {
+            v[r] = pc->queue_window[(size_t) r * QUEUE_DEPTH_FIELDS + i];
+            sum += v[r];
+        }
+        qsort(v, n, sizeof (uint64_t), uint64_compare);
+        (void) snprintf(key, sizeof (key), "%s_min", name);
+        lp_field_uint(out, key, v[0]);
+        (void) snprintf(key, sizeof (key), "%s_max", name);
+        lp_field_uint(out, key, v[n - 1]);
+        (void) snprintf(key, sizeof (key), "%s_mean", name);
+        lp_field_fixed(out, key, (double) sum / n, 2);
+        /* nearest rank */
+        (void) snprintf(key, sizeof (key), "%s_p99", name);
+        lp_field_uint(out, key, v[(n * 99 + 99) / 100 - 1]);
+    }
+    lp_field_uint(out, "samples", n);
+    lp_end(out, sample->timestamp);
+    return (0);
+}
+
+/*
+ * print_scan_status() prints the details as often seen in the "zpool status"
+ * output. However, unlike the zpool command, which is intended for humans,
+ * this output is suitable for long-term tracking in influxdb.
+ *
+ * The rates over the whole pass hide what a long scan on a busy pool is
+ * doing now, so the examined and issued bytes are also kept in the pool's
+ * cache for the rates since the last sample. The issue rate is smoothed
+ * with an exponentially weighted moving average, SCAN_EWMA_SECS being its
+ * time constant whatever the interval, which gives the remaining_ewma_t
+ * estimate. As at the start of a scan there is no last sample, the average
+ * starts from the pass's. Like zpool status, the estimates go by the bytes
+ * issued, as with sequential scans examined runs far ahead of the I/O.
+ */
+#define SCAN_EWMA_SECS  300
+
+int
+print_scan_status(pool_sample_t *sample, nvlist_t *nvroot) {
+	lp_writer_t *out = sample->out;
+	const char *pool_name = sample->pc->escaped_name;
+	uint_t c;
+	int64_t elapsed;
+	uint64_t examined, pass_exam, paused_time, paused_ts, rate;
+	uint64_t remaining_time, pass_issued, issue_rate, left;
+	pool_cache_t *pc = sample->pc;
+	pool_scan_stat_t *ps = NULL;
+	double pct_done, secs, w;
+	double examined_rate = -1, issued_rate = -1;
+	char *state[DSS_NUM_STATES] = {"none", "scanning", "finished",
+	                               "canceled"};
+	char *func;
+
+	(void) nvlist_lookup_uint64_array(nvroot,
+	    ZPOOL_CONFIG_SCAN_STATS,
+	    (uint64_t **) &ps, &c);
+
+	/*
+	 * ignore if there are no stats
+	 */
+	if (ps == NULL) {
+		pc->scan_when = 0;
+		return (0);
+	}
+
+	/*
+	 * return error if state is bogus
+	 */
+	if (ps->pss_state >= DSS_NUM_STATES ||
+	    ps->pss_func >= POOL_SCAN_FUNCS) {
+	    if (complained_about_sync % 1000 == 0) {
+            fprintf(stderr, "error: cannot decode scan stats: ZFS is "
+                            "out of sync with compiled zpool_influxdb");
+            complained_about_sync++;
+        }
+		return (1);
+	}
+
+	switch (ps->pss_func) {
+		case POOL_SCAN_NONE:
+			func = "none_requested";
+			break;
+		case POOL_SCAN_SCRUB:
+			func = "scrub";
+			break;
+		case POOL_SCAN_RESILVER:
+			func = "resilver";
+			break;
+#ifdef POOL_SCAN_REBUILD
+		case POOL_SCAN_REBUILD:
+				func = "rebuild";
+				break;
+#endif
+		default:
+			func = "scan";
+	}
+
+	/* overall progress */
+	examined = ps->pss_examined ? ps->pss_examined : 1;
+	pct_done = 0.0;
+	if (ps->pss_to_examine > 0)
+		pct_done = 100.0 * examined / ps->pss_to_examine;
+
+#ifdef EZFS_SCRUB_PAUSED
+	paused_ts = ps->pss_pass_scrub_pause;
+	paused_time = ps->pss_pass_scrub_spent_paused;
+#else
+	paused_ts = 0;
+	paused_time = 0;
+#endif
+
+	/* calculations for this pass */
+	left = ps->pss_to_examine > ps->pss_issued ?
+	    ps->pss_to_examine - ps->pss_issued : 0;
+	pass_issued = ps->pss_pass_issued;
+	if (ps->pss_state == DSS_SCANNING) {
+		elapsed = (int64_t) time(NULL) - (int64_t) ps->pss_pass_start -
+		          (int64_t) paused_time;
+		elapsed = (elapsed > 0) ? elapsed : 1;
+		pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
+		rate = pass_exam / elapsed;
+		rate = (rate > 0) ? rate : 1;
+		issue_rate = pass_issued / elapsed;
+		/* until the pass issues something, there is no estimate */
+		if (pass_issued == 0) {
+			remaining_time = UINT64_MAX;
+		} else {
+			issue_rate = (issue_rate > 0) ? issue_rate : 1;
+			remaining_time = left / issue_rate;
+		}
+	} else {
+		elapsed =
+		    (int64_t) ps->pss_end_time - (int64_t) ps->pss_pass_start -
+		    (int64_t) paused_time;
+		elapsed = (elapsed > 0) ? elapsed : 1;
+		pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
+		rate = pass_exam / elapsed;
+		issue_rate = pass_issued / elapsed;
+		remaining_time = 0;
+	}
+	rate = rate ? rate : 1;
+
+	/* since the last sample, if that was of the same scan */
+	if (ps->pss_state != DSS_SCANNING) {
+		pc->scan_when = 0;
+	} else if (pc->scan_when != 0 && pc->scan_start ==
+	    ps->pss_start_time && pc->scan_func == ps->pss_func &&
+	    sample->hrtime > pc->scan_when &&
+	    ps->pss_examined >= pc->scan_examined &&
+	    ps->pss_issued >= pc->scan_issued) {
+		secs = (double) (sample->hrtime - pc->scan_when) / 1e9;
+		examined_rate = (double) (ps->pss_examined -
+		    pc->scan_examined) / secs;
+		issued_rate = (double) (ps->pss_issued - pc->scan_issued) /
+		    secs;
+		/*
+		 * a pause says nothing about the rate once it's resumed, nor
+		 * does the interval it ended in
+		 */
+		if (paused_ts == 0 && !pc->scan_paused) {
+			/* about 1 - e^(-secs / SCAN_EWMA_SECS) */
+			w = secs / (SCAN_EWMA_SECS + secs);
+			pc->scan_ewma += w * (issued_rate - pc->scan_ewma);
+		}
+	} else {
+		/* a new scan starts from the pass's average */
+		pc->scan_ewma = (double) issue_rate;
+	}
+	if (ps->pss_state == DSS_SCANNING) {
+		pc->scan_start = ps->pss_start_time;
+		pc->scan_func = ps->pss_func;
+		pc->scan_examined = ps->pss_examined;
+		pc->scan_issued = ps->pss_issued;
+		pc->scan_paused = paused_ts != 0;
+		pc->scan_when = sample->hrtime;
+	}
+
+	/* influxdb line protocol format: "tags metrics timestamp" */
+	lp_measurement(out, SCAN_MEASUREMENT);
+	lp_tag(out, "function", func);
+	lp_tag(out, "name", pool_name);
+	lp_tag(out, "state", state[ps->pss_state]);
+	lp_field_uint(out, "end_ts", MASK_UINT64(ps->pss_end_time));
+	lp_field_uint(out, "errors", MASK_UINT64(ps->pss_errors));
+	lp_field_uint(out, "examined", MASK_UINT64(examined));
+	if (examined_rate >= 0)
+		lp_field_fixed(out, "examined_rate_now", examined_rate, 0);
+	lp_field_uint(out, "issue_rate", MASK_UINT64(issue_rate));
+	lp_field_uint(out, "issued", MASK_UINT64(ps->pss_issued));
+	if (ps->pss_state == DSS_SCANNING)
+		lp_field_fixed(out, "issued_rate_ewma", pc->scan_ewma, 0);
+	if (issued_rate >= 0)
+		lp_field_fixed(out, "issued_rate_now", issued_rate, 0);
+	lp_field_uint(out, "pass_examined", MASK_UINT64(pass_exam));
+	lp_field_uint(out, "pass_issued", MASK_UINT64(pass_issued));
+	lp_field_uint(out, "pause_ts", MASK_UINT64(paused_ts));
+	lp_field_uint(out, "paused_t", MASK_UINT64(paused_time));
+	lp_field_fixed(out, "pct_done", pct_done, 2);
+	lp_field_uint(out, "processed", MASK_UINT64(ps->pss_processed));
+	lp_field_uint(out, "rate", MASK_UINT64(rate));
+	/* left out while nothing is being issued */
+	if (ps->pss_state == DSS_SCANNING && pc->scan_ewma >= 1)
+		lp_field_uint(out, "remaining_ewma_t",
+		    MASK_UINT64((uint64_t) (left / pc->scan_ewma)));
+	if (remaining_time != UINT64_MAX)
+		lp_field_uint(out, "remaining_t", MASK_UINT64(remaining_time));
+	lp_field_uint(out, "start_ts", MASK_UINT64(ps->pss_start_time));
+	lp_field_uint(out, "to_examine", MASK_UINT64(ps->pss_to_examine));
+	lp_field_uint(out, "to_process", MASK_UINT64(ps->pss_to_process));
+	lp_end(out, sample->timestamp);
+	return (0);
+}
+
+/*
+ * The per-vdev printers, in the order they run for each vdev. Printers
+ * that don't descend only run on the root vdev. The order matters: if a
+ * printer fails on the root vdev, it and all of the printers after it are
+ * skipped, which is the same "skip the rest" rule print_stats() uses.
+ */
+typedef int (*vdev_printer_f)(vdev_info_t *);
+
+struct vdev_printer {
+    vdev_printer_f func;
+    int descend;
+    int histogram;      /* disabled by --no-histograms */
+    int *also;          /* unless this option is set, too */
+    const char *name;   /* for the bench */
+};
+
+struct vdev_printer vdev_printers[] = {
+    {print_summary_stats,        1, 0, NULL, "summary"},
+    {print_shm_vdev,             1, 0, NULL, "shm"},
+    {print_vdev_info,            1, 0, NULL, "info"},
+    {print_vdev_rates,           1, 0, NULL, "rates"},
+    {print_top_level_vdev_stats, 0, 0, NULL, "top_level"},
+    {print_class_stats,          0, 0, NULL, "classes"},
+    {print_vdev_latency_stats,   1, 1, &latency_summary, "latency"},
+    {print_vdev_size_stats,      1, 1, NULL, "size"},
+    {print_queue_stats,          0, 1, NULL, "queue"},
+    {NULL,                       0, 0, NULL, NULL}
+};
+
+/*
+ * --select and --fields-file: print only the per-vdev measurements that
+ * are named, and of the histograms and queues only the fields listed, as
+ * in "zpool_latency:total_read,total_write". The other measurements have
+ * options of their own.
+ */
+typedef struct select_measurement {
+    const char *measurement;
+    const char *printer;        /* in vdev_printers[] */
+    stat_field_t *fields;       /* NULL if the fields can't be picked */
+    uint_t bit;                 /* in fields[].print */
+    int selected;
+    int listed;                 /* with a list of fields */
+} select_measurement_t;
+
+select_measurement_t select_measurements[] = {
+    {POOL_MEASUREMENT,      "summary",   NULL,              0, 0, 0},
+    {POOL_RATES_MEASUREMENT, "rates",    NULL,              0, 0, 0},
+    {VDEV_MEASUREMENT,      "top_level", pool_queue_fields, SELECT_FIELD, 0, 0},
+    {POOL_LATENCY_MEASUREMENT, "latency", lat_fields,       SELECT_FIELD, 0, 0},
+    {POOL_LATENCY_SUMMARY_MEASUREMENT, "latency", lat_fields,
+     SELECT_SUMMARY, 0, 0},
+    {POOL_IO_SIZE_MEASUREMENT, "size",   size_fields,       SELECT_FIELD, 0, 0},
+    {POOL_QUEUE_MEASUREMENT, "queue",    queue_fields,      SELECT_FIELD, 0, 0},
+    {0}
+};
+
+int select_given = 0;
+uint_t select_printers = 0;     /* vdev_printers[] bits, if select_given */
+
+select_measurement_t *
+select_find(const char *measurement) {
+    select_measurement_t *sm;
+
+    for (sm = select_measurements; sm->measurement != NULL; sm++) {
+        if (strcmp(sm->measurement, measurement) == 0)
+            return (sm);
+    }
+    return (NULL);
+}
+
+/*
+ * parse "measurement[:field[,field]...]"
+ */
+int
+select_parse(char *spec) {
+    select_measurement_t *sm;
+    stat_field_t *f;
+    char *fields, *field, *last;
+
+    if ((fields = strchr(spec, ':')) != NULL)
+        *fields++ = '\0';
+    if ((sm = select_find(spec)) == NULL) {
+        fprintf(stderr,
+                "error: --select: %s is not a per-vdev measurement\n", spec);
+        return (1);
+    }
+    select_given = 1;
+    sm->selected = 1;
+    if (fields == NULL)
+        return (0);
+    if (sm->fields == NULL) {
+        fprintf(stderr, "error: --select: the fields of %s can't be "
+                        "selected\n", spec);
+        return (1);
+    }
+
+    /* the first list for a measurement replaces all of its fields */
+    if (!sm->listed) {
+        for (f = sm->fields; f->name != NULL; f++)
+            f->print &= ~sm->bit;
+        sm->listed = 1;
+    }
+    for (field = strtok_r(fields, ",", &last); field != NULL;
+         field = strtok_r(NULL, ",", &last)) {
+        for (f = sm->fields; f->name != NULL; f++) {
+            if (strcmp(f->short_name, field) == 0)
+                break;
+        }
+        if (f->name == NULL) {
+            fprintf(stderr, "error: --select: %s has no field %s\n", spec,
+                    field);
+            return (1);
+        }
+        f->print |= sm->bit;
+    }
+    return (0);
+}
+
+/*
+ * read --select specs from a file, one per line, with # comments
+ */
+int
+select_file(const char *path) {
+    FILE *fp;
+    char *line = NULL, *p, *end;
+    size_t len = 0;
+    int err = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "error: cannot open %s: %s\n", path,
+                strerror(errno));
+        return (1);
+    }
+    while (err == 0 && getline(&line, &len, fp) != -1) {
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        p = line + strspn(line, " \t\r\n");
+        end = p + strcspn(p, " \t\r\n");
+        *end = '\0';
+        if (*p != '\0')
+            err = select_parse(p);
+    }
+    free(line);
+    (void) fclose(fp);
+    return (err);
+}
+
+/*
+ * turn the selection into the printers to run and pack the field tables,
+ * once at startup
+ */
+void
+select_compile(void) {
+    select_measurement_t *sm;
+    stat_field_t *tables[] = {
+        lat_fields, size_fields, queue_fields, pool_queue_fields, NULL
+    };
+    uint_t n;
+
+    if (!select_given)
+        return;
+    for (sm = select_measurements; sm->measurement != NULL; sm++) {
+        if (!sm->selected) {
+            for (n = 0; sm->fields != NULL && sm->fields[n].name; n++)
+                sm->fields[n].print &= ~sm->bit;
+            continue;
+        }
+        for (int i = 0; vdev_printers[i].func; i++) {
+            if (strcmp(vdev_printers[i].name, sm->printer) == 0)
+                select_printers |= 1U << i;
+        }
+    }
+    /* --shm, --guid-tags and --classes have options of their own */
+    for (int i = 0; vdev_printers[i].func; i++) {
+        if (vdev_printers[i].func == print_shm_vdev ||
+            vdev_printers[i].func == print_vdev_info ||
+            vdev_printers[i].func == print_class_stats)
+            select_printers |= 1U << i;
+    }
+    /* the options the latency printer and the rates already go by */
+    no_latency_buckets = !select_find(POOL_LATENCY_MEASUREMENT)->selected;
+    latency_summary = select_find(POOL_LATENCY_SUMMARY_MEASUREMENT)->selected;
+    print_rates = select_find(POOL_RATES_MEASUREMENT)->selected;
+
+    for (int t = 0; tables[t] != NULL; t++) {
+        n = 0;
+        for (int i = 0; tables[t][i].name; i++) {
+            if (tables[t][i].print != 0)
+                tables[t][n++] = tables[t][i];
+        }
+        tables[t][n].name = NULL;
+        tables[t][n].short_name = NULL;
+    }
+}
+
+/*
+ * --top-leaves: with hundreds of disks, usually only the busiest or the
+ * slowest ones are of interest. Before the printers run, rank_leaves()
+ * scores each leaf below the top-level vdevs by its ops, or by its mean
+ * latency, since the last sample and the top N are marked. The other
+ * leaves are left out of this sample. Their baselines for --rates and
+ * --histogram-deltas carry over, so when they are printed again the rates
+ * and increments cover the whole time since they were last printed.
+ *
+ * The first sample of a leaf is scored on its counts since the import.
+ */
+double
+leaf_score(vdev_cache_entry_t *ve, nvlist_t *nvroot) {
+    static const char *lat_names[] = {
+        ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO, ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO
+    };
+    vdev_stat_t *vs;
+    nvlist_t *nv_ex;
+    uint64_t *h, ops = 0, count = 0, dcount;
+    uint_t c;
+    double sum = 0, dsum, score;
+
+    if (top_leaves_by == TOP_BY_OPS) {
+        if (nvlist_lookup_uint64_array(nvroot, ZPOOL_CONFIG_VDEV_STATS,
+                                       (uint64_t **) &vs, &c) == 0)
+            ops = vs->vs_ops[ZIO_TYPE_READ] + vs->vs_ops[ZIO_TYPE_WRITE];
+        score = (double) (ops >= ve->top_ops ? ops - ve->top_ops : ops);
+        ve->top_ops = ops;
+        return (score);
+    }
+
+    if (nvlist_lookup_nvlist(nvroot, ZPOOL_CONFIG_VDEV_STATS_EX,
+                             &nv_ex) == 0) {
+        for (uint_t i = 0; i < 2; i++) {
+            if (nvlist_lookup_uint64_array(nv_ex, lat_names[i], &h,
+                                           &c) != 0)
+                continue;
+            for (uint_t b = 0; b < c; b++) {
+                count += h[b];
+                sum += (double) h[b] *
+                       (lat_bucket_low(b) + lat_bucket_low(b + 1)) / 2;
+            }
+        }
+    }
+    if (count >= ve->top_lat_count && sum >= ve->top_lat_sum) {
+        dcount = count - ve->top_lat_count;
+        dsum = sum - ve->top_lat_sum;
+    } else {
+        dcount = count;
+        dsum = sum;
+    }
+    ve->top_lat_count = count;
+    ve->top_lat_sum = sum;
+    return (dcount ? dsum / (double) dcount : 0);
+}
+
+/*
+ * score the leaves of the tree, in the same order and with the same
+ * cache lookups as walk_vdev_tree()
+ */
+void
+rank_leaves(pool_sample_t *sample, nvlist_t *nvroot, const char *parent_name,
+            uint64_t parent_guid, int depth) {
+    pool_cache_t *pc = sample->pc;
+    vdev_cache_entry_t *ve;
+    nvlist_t **child;
+    uint_t c, children;
+    char vdev_name_buf[VDEV_NAME_LEN];
+    const char *vdev_name;
+    uint64_t guid;
+
+    ve = vdev_cache_lookup(pc, nvroot, parent_name, parent_guid);
+    if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+                                   &child, &children) != 0 ||
+        children == 0) {
+        /* the top-level vdevs are always printed */
+        if (ve == NULL || depth < 2)
+            return;
+        if (pc->nranks == pc->ranks_size) {
+            pc->ranks_size = pc->ranks_size ? pc->ranks_size * 2 : 64;
+            pc->ranks = safe_realloc(pc->ranks,
+                                     pc->ranks_size * sizeof (leaf_rank_t));
+        }
+        pc->ranks[pc->nranks].guid = ve->guid;
+        pc->ranks[pc->nranks].score = leaf_score(ve, nvroot);
+        pc->nranks++;
+        return;
+    }
+    if (max_depth >= 0 && depth >= max_depth)
+        return;
+
+    if (ve != NULL) {
+        vdev_name = ve->vdev_name;
+        guid = ve->guid;
+    } else {
+        vdev_name = get_vdev_name(nvroot, parent_name, vdev_name_buf,
+                                  sizeof (vdev_name_buf));
+        guid = 0;
+    }
+    for (c = 0; c < children; c++)
+        rank_leaves(sample, child[c], vdev_name, guid, depth + 1);
+}
+
+/* highest score first, ties in GUID order so the pick is stable */
+int
+leaf_rank_compare(const void *a, const void *b) {
+    const leaf_rank_t *ra = a, *rb = b;
+
+    if (ra->score != rb->score)
+        return (ra->score > rb->score ? -1 : 1);
+    return (ra->guid < rb->guid ? -1 : ra->guid > rb->guid);
+}
+
+void
+pick_top_leaves(pool_sample_t *sample, nvlist_t *nvroot) {
+    pool_cache_t *pc = sample->pc;
+
+    pc->nranks = 0;
+    rank_leaves(sample, nvroot, NULL, 0, 0);
+    qsort(pc->ranks, pc->nranks, sizeof (leaf_rank_t), leaf_rank_compare);
+    /* nothing is added to the cache until the walk, so the slots stay */
+    for (uint_t i = 0; i < pc->nranks; i++) {
+        vdev_cache_slot(pc->entries, pc->size, pc->ranks[i].guid)->top_pick =
+            i < top_leaves;
+    }
+}
+
+/*
+ * walk the vdev tree once, running each enabled printer on each vdev
+ *
+ * "enabled" is a bitmask indexed by vdev_printers[]. If a printer fails
+ * on a vdev, it is not run on that vdev's children, just like the old
+ * per-printer recursion. Only errors at the root vdev are returned.
+ * depth is 0 at the root and 1 at the top-level vdevs. The tree isn't
+ * walked below --max-depth.
+ */
+int
+walk_vdev_tree(pool_sample_t *sample, nvlist_t *nvroot,
+               const char *parent_name, uint64_t parent_guid,
+               uint_t enabled, int depth) {
+    uint_t c, children;
+    nvlist_t **child;
+    char vdev_name_buf[VDEV_NAME_LEN];
+    char vdev_desc_buf[VDEV_DESC_LEN];
+    const char *vdev_name;
+    vdev_cache_entry_t *ve;
+    vdev_info_t vi;
+    stats_ex_t sx;
+    uint64_t guid;
+    int err = 0, e;
+
+    vi.out = sample->out;
+    vi.timestamp = sample->timestamp;
+    vi.hrtime = sample->hrtime;
+    vi.nvroot = nvroot;
+    vi.pc = sample->pc;
+    vi.pool_name = sample->pc->escaped_name;
+    vi.parent_name = parent_name;
+    vi.depth = depth;
+    if (nvlist_lookup_nvlist(nvroot, ZPOOL_CONFIG_VDEV_STATS_EX,
+                             &vi.nv_ex) != 0) {
+        vi.nv_ex = NULL;
+    }
+    vi.sx = &sx;
+    vi.sx_decoded = 0;
+    ve = vdev_cache_lookup(sample->pc, nvroot, parent_name, parent_guid);
+    vi.ve = ve;
+    if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+                                   &child, &children) != 0)
+        children = 0;
+    /* a leaf that isn't among the --top-leaves, unless something happened */
+    if (top_leaves != 0 && children == 0 && depth >= 2 && ve != NULL &&
+        !ve->top_pick && !sample->event)
+        return (0);
+    sample->vdevs++;
+
+    vi.vdev_desc = ve ? ve->vdev_desc :
+        get_vdev_desc(nvroot, parent_name, vdev_desc_buf,
+                      sizeof (vdev_desc_buf), 0);
+
+    for (int i = 0; vdev_printers[i].func; i++) {
+        if ((enabled & (1U << i)) == 0)
+            continue;
+        if ((e = vdev_printers[i].func(&vi)) == 0)
+            continue;
+        if (parent_name == NULL) {
+            /* at the root, skip the rest */
+            err = e;
+            enabled &= (1U << i) - 1;
+            break;
+        }
+        enabled &= ~(1U << i);
+    }
+
+    /* only the printers that descend are passed to the children */
+    for (int i = 0; vdev_printers[i].func; i++) {
+        if (vdev_printers[i].descend == 0)
+            enabled &= ~(1U << i);
+    }
+
+    if (enabled && children != 0 && (max_depth < 0 || depth < max_depth)) {
+        /*
+         * the children's lookups can grow the cache and realloc() the
+         * entries, so ve must not be read after them; the guid is copied
+         * first, while the name it points to stays put
+         */
+        if (ve != NULL) {
+            vdev_name = ve->vdev_name;
+            guid = ve->guid;
+        } else {
+            vdev_name = get_vdev_name(nvroot, parent_name, vdev_name_buf,
+                                      sizeof (vdev_name_buf));
+            guid = 0;
+        }
+
+        for (c = 0; c < children; c++) {
+            (void) walk_vdev_tree(sample, child[c], vdev_name, guid,
+                                  enabled, depth + 1);
+        }
+    }
+    return (err);
+}
+
+/*
+ * --internal-stats: what sampling a pool cost, with the lines and bytes
+ * printed for it not counting this line
+ */
+void
+print_internal_pool_stats(pool_sample_t *sample, uint64_t start,
+                          uint64_t lines, uint64_t bytes) {
+    lp_writer_t *out = sample->out;
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    lines = out->lines - lines;
+    bytes = out->bytes + out->len - bytes;
+    lp_measurement(out, INTERNAL_MEASUREMENT);
+    lp_tag(out, "name", sample->pc->escaped_name);
+    lp_field_uint(out, "refresh_time", sample->refresh_time);
+    lp_field_uint(out, "format_time", now - start);
+    lp_field_uint(out, "lines", lines);
+    lp_field_uint(out, "bytes", bytes);
+    lp_field_uint(out, "vdevs", sample->vdevs);
+    lp_end(out, sample->timestamp);
+}
+
+/*
+ * --internal-stats: the process as a whole, once per sample
+ */
+void
+print_internal_stats(uint64_t start) {
+    lp_writer_t *out = &output_writer;
+    unsigned long size, resident;
+    FILE *fp;
+    int have_rss = 0;
+
+    /* Linux only, elsewhere the rss is left out */
+    if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+        have_rss = fscanf(fp, "%lu %lu", &size, &resident) == 2;
+        (void) fclose(fp);
+    }
+    lp_measurement(out, INTERNAL_MEASUREMENT);
+    lp_field_uint(out, "sample_time", clock_ns(CLOCK_MONOTONIC) - start);
+    if (have_rss) {
+        lp_field_uint(out, "rss",
+                      (uint64_t) resident * (uint64_t) sysconf(_SC_PAGESIZE));
+    }
+    lp_end(out, sample_time != 0 ? sample_time : clock_ns(CLOCK_REALTIME));
+}
+
+kstat_reader_t arc_kstat = { .name = "arcstats", .prefix = "arcstats_",
+                             .fd = -1 };
+
+
+/*
+ * the path of a kstat, or of a pool's kstat directory
+ */
+const char *
+kstat_path(const char *name, char *path, size_t len) {
+    const char *proc = getenv("HOST_PROC");
+
+    (void) snprintf(path, len, "%s/spl/kstat/zfs/%s",
+                    proc != NULL && *proc != '\0' ? proc : "/proc", name);
+    return (path);
+}
+
+int
+kstat_open(kstat_reader_t *k) {
+    char path[PATH_MAX];
+
+    (void) kstat_path(k->name, path, sizeof (path));
+    if ((k->fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "error: cannot open %s: %s\n", path,
+                strerror(errno));
+        return (1);
+    }
+    return (0);
+}
+
+/*
+ * read the whole kstat into k->buf, which is NUL terminated
+ */
+int
+kstat_read(kstat_reader_t *k) {
+    ssize_t n;
+
+    k->len = 0;
+    for (;;) {
+        if (k->size - k->len < 2) {
+            k->size = k->size ? k->size * 2 : 16 * 1024;
+            k->buf = safe_realloc(k->buf, k->size);
+        }
+        n = pread(k->fd, k->buf + k->len, k->size - k->len - 1,
+                  (off_t) k->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "error: cannot read the %s kstat: %s\n", k->name,
+                    strerror(errno));
+            return (1);
+        }
+        if (n == 0)
+            break;
+        k->len += (size_t) n;
+    }
+    k->buf[k->len] = '\0';
+    return (0);
+}
+
+/*
+ * build the field table from the text in k->buf
+ */
+int
+kstat_build_fields(kstat_reader_t *k) {
+    char *p, *eol, *data;
+    uint_t size = 0;
+    size_t n;
+
+    kstat_free_fields(k);
+    /* skip the header, the column titles give the data column */
+    if ((p = strchr(k->buf, '\n')) == NULL ||
+        (eol = strchr(++p, '\n')) == NULL ||
+        (data = strstr(p, " data")) == NULL || data > eol)
+        return (1);
+    k->data_col = (size_t) (data + 1 - p);
+
+    for (p = eol + 1; *p != '\0'; p = eol + 1) {
+        if ((eol = strchr(p, '\n')) == NULL)
+            eol = p + strlen(p);
+        if (k->nfields == size) {
+            size = size ? size * 2 : 256;
+            k->fields = safe_realloc(k->fields,
+                                     size * sizeof (kstat_field_t));
+        }
+        n = strcspn(p, " \n");
+        k->fields[k->nfields].name = safe_calloc(1, n + 1);
+        (void) memcpy(k->fields[k->nfields].name, p, n);
+        k->fields[k->nfields].name_len = n;
+        k->fields[k->nfields].field =
+            safe_calloc(1, strlen(k->prefix) + n + 1);
+        (void) sprintf(k->fields[k->nfields].field, "%s%s", k->prefix,
+                       k->fields[k->nfields].name);
+        k->fields[k->nfields].type = (int) strtol(p + n, NULL, 10);
+        if ((size_t) (eol - p) <= k->data_col ||
+            k->fields[k->nfields].type < KSTAT_DATA_INT32 ||
+            k->fields[k->nfields].type > KSTAT_DATA_UINT64)
+            k->fields[k->nfields].type = 0;
+        k->nfields++;
+        if (*eol == '\0')
+            break;
+    }
+    return (k->nfields == 0);
+}
+
+/*
+ * print the numeric fields of a named kstat in k->buf to the current line
+ *
+ * Returns non-zero if the text doesn't match the field table.
+ */
+int
+kstat_print_fields(kstat_reader_t *k, lp_writer_t *out) {
+    char *p, *eol;
+    kstat_field_t *f;
+
+    if ((p = strchr(k->buf, '\n')) == NULL ||
+        (p = strchr(p + 1, '\n')) == NULL)
+        return (1);
+    p++;
+    for (uint_t i = 0; i < k->nfields; i++, p = eol + 1) {
+        f = &k->fields[i];
+        if ((eol = strchr(p, '\n')) == NULL)
+            eol = p + strlen(p);
+        if ((size_t) (eol - p) <= k->data_col ||
+            memcmp(p, f->name, f->name_len) != 0 || p[f->name_len] != ' ')
+            return (1);
+        if (f->type == KSTAT_DATA_INT32 || f->type == KSTAT_DATA_INT64)
+            lp_field_int(out, f->field, strtoll(p + k->data_col, NULL, 10));
+        else if (f->type != 0)
+            lp_field_uint(out, f->field,
+                          MASK_UINT64(strtoull(p + k->data_col, NULL, 10)));
+        if (*eol == '\0')
+            return (i + 1 != k->nfields);
+    }
+    /* more lines than fields */
+    return (*p != '\0');
+}
+
+/*
+ * make sure the field table matches the kstat in k->buf, building it if
+ * needed, and return the index of the line with the name, or -1
+ */
+int
+kstat_field_index(kstat_reader_t *k, const char *name) {
+    for (int tries = 0; tries < 2; tries++) {
+        if (k->nfields == 0 && kstat_build_fields(k) != 0)
+            return (-1);
+        for (uint_t i = 0; i < k->nfields; i++) {
+            if (strcmp(k->fields[i].name, name) == 0)
+                return ((int) i);
+        }
+        kstat_free_fields(k);
+    }
+    return (-1);
+}
+
+/*
+ * the value of a string field, which runs to the end of its line
+ */
+const char *
+kstat_string(kstat_reader_t *k, int index, size_t *len) {
+    char *p = k->buf;
+
+    for (int i = 0; i < index + 2 && p != NULL; i++) {
+        if ((p = strchr(p, '\n')) != NULL)
+            p++;
+    }
+    if (p == NULL || strlen(p) <= k->data_col)
+        return (NULL);
+    p += k->data_col;
+    *len = strcspn(p, "\n");
+    return (p);
+}
+
+/*
+ * print a named kstat in k->buf as one line with the numeric fields
+ */
+int
+kstat_print(kstat_reader_t *k, lp_writer_t *out, const char *measurement,
+            const char *tags, uint64_t ts) {
+    size_t mark;
+
+    for (int tries = 0; ; tries++) {
+        mark = out->len;
+        lp_measurement(out, measurement);
+        if (tags != NULL)
+            lp_tags(out, tags);
+        if (k->nfields != 0 && kstat_print_fields(k, out) == 0 &&
+            out->nfields != 0)
+            break;
+        /* throw away the partial line and start over with a new table */
+        out->len = mark;
+        if (tries == 1 || kstat_build_fields(k) != 0) {
+            fprintf(stderr, "error: cannot parse the %s kstat\n", k->name);
+            return (1);
+        }
+    }
+    lp_end(out, ts);
+    return (0);
+}
+
+/*
+ * --arcstats: the ARC and L2ARC stats, as one line with the same
+ * measurement and field names as telegraf's zfs input
+ */
+int
+print_arcstats(lp_writer_t *out, uint64_t ts) {
+    if (kstat_read(&arc_kstat) != 0)
+        return (1);
+    return (kstat_print(&arc_kstat, out, ARC_MEASUREMENT, NULL, ts));
+}
+
+/*
+ * --txgs: the txg history of a pool, from its txgs kstat. ZFS keeps the
+ * last zfs_txg_history txgs, oldest first. Only the txgs committed since
+ * the last sample are printed, so the table is searched from the end for
+ * the last one printed and only the rows after it are parsed.
+ *
+ * Each txg is printed with the time it finished syncing as its timestamp,
+ * so they don't overwrite each other. After a restart, the txgs that are
+ * printed again have the same timestamps.
+ */
+static const char *txg_columns[] = {
+    "txg", "birth", "state", "ndirty", "nread", "nwritten", "reads",
+    "writes", "otime", "qtime", "wtime", "stime", NULL
+};
+
+#define TXG_COL_TXG     0
+#define TXG_COL_BIRTH   1
+#define TXG_COL_STATE   2
+#define TXG_COL_OTIME   8
+#define TXG_COLUMNS     12
+#define TXG_MAX_TOKENS  32
+
+/*
+ * the txg kstat times are from gethrtime(), the raw monotonic clock
+ */
+uint64_t
+hrtime_offset(void) {
+#ifdef CLOCK_MONOTONIC_RAW
+    return (clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC_RAW));
+#else
+    return (clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC));
+#endif
+}
+
+int
+print_txgs(pool_sample_t *sample) {
+    pool_cache_t *pc = sample->pc;
+    kstat_reader_t *k = &pc->txgs;
+    lp_writer_t *out = sample->out;
+    int map[TXG_MAX_TOKENS];
+    uint64_t v[TXG_COLUMNS], offset, last = pc->last_txg;
+    char *p, *eol, *body, *q, state;
+    char *name;
+    size_t n;
+    int ntokens = 0, col;
+
+    if (k->name == NULL) {
+        name = safe_calloc(1, strlen(pc->name) + sizeof ("/txgs"));
+        (void) sprintf(name, "%s/txgs", pc->name);
+        k->name = name;
+        if (kstat_open(k) != 0)
+            return (12);
+    }
+    /* it didn't open the first time, which was reported */
+    if (k->fd < 0)
+        return (0);
+    if (kstat_read(k) != 0)
+        return (12);
+
+    /* skip the kstat header, the column titles say which token is which */
+    if ((p = strchr(k->buf, '\n')) == NULL)
+        return (0);
+    for (p++; *p != '\0' && *p != '\n' && ntokens < TXG_MAX_TOKENS;
+         ntokens++) {
+        n = strcspn(p, " \n");
+        map[ntokens] = -1;
+        for (col = 0; txg_columns[col] != NULL; col++) {
+            if (strlen(txg_columns[col]) == n &&
+                strncmp(p, txg_columns[col], n) == 0)
+                map[ntokens] = col;
+        }
+        for (p += n; *p == ' '; p++)
+            ;
+    }
+    if (*p != '\n')
+        return (0);
+    body = p + 1;
+
+    /* back from the end to the last txg printed */
+    for (p = k->buf + k->len; p > body; p = q) {
+        for (q = p - 1; q > body && q[-1] != '\n'; q--)
+            ;
+        if (strtoull(q, NULL, 10) <= last)
+            break;
+    }
+
+    offset = hrtime_offset();
+    for (; *p != '\0'; p = eol + (*eol != '\0')) {
+        if ((eol = strchr(p, '\n')) == NULL)
+            eol = p + strlen(p);
+        (void) memset(v, 0, sizeof (v));
+        state = '\0';
+        for (int t = 0; t < ntokens && p < eol; t++) {
+            while (*p == ' ')
+                p++;
+            if (map[t] == TXG_COL_STATE)
+                state = *p;
+            else if (map[t] >= 0)
+                v[map[t]] = strtoull(p, NULL, 10);
+            p += strcspn(p, " \n");
+        }
+        if (v[TXG_COL_TXG] <= last)
+            continue;
+        /* the rest are still open, quiescing or syncing */
+        if (state != 'C')
+            break;
+
+        lp_measurement(out, TXG_MEASUREMENT);
+        lp_tag(out, "name", pc->escaped_name);
+        for (col = 0; col < TXG_COLUMNS; col++) {
+            if (col != TXG_COL_BIRTH && col != TXG_COL_STATE)
+                lp_field_uint(out, txg_columns[col], MASK_UINT64(v[col]));
+        }
+        lp_end(out, offset + v[TXG_COL_BIRTH] + v[TXG_COL_OTIME] +
+               v[TXG_COL_OTIME + 1] + v[TXG_COL_OTIME + 2] +
+               v[TXG_COL_OTIME + 3]);
+        pc->last_txg = v[TXG_COL_TXG];
+    }
+    return (0);
+}
+
+/*
+ * --datasets: per-dataset I/O from the pool's objset-0x<id> kstats. With
+ * thousands of datasets, opening and allocating for each file on every
+ * sample adds up, so the files are kept open in the pool cache. They all
+ * have the same fields, so they share one read buffer and field table.
+ * The kstat directory is only read to count the objsets, and scanned
+ * again to open them when the count changes or an open one can't be read
+ * because its dataset was destroyed.
+ */
+int
+objset_compare(const void *a, const void *b) {
+    const objset_kstat_t *oa = a, *ob = b;
+
+    return (oa->objset < ob->objset ? -1 : oa->objset > ob->objset);
+}
+
+/*
+ * count the objset kstats, or with pc != NULL open them too
+ */
+int
+objsets_scan(const char *dir, pool_cache_t *pc, uint_t *count) {
+    static int complained = 0;
+    DIR *dp;
+    struct dirent *de;
+    char path[PATH_MAX];
+    uint64_t objset;
+    uint_t size = 0;
+    char *end;
+    int fd;
+
+    if ((dp = opendir(dir)) == NULL)
+        return (1);
+    *count = 0;
+    while ((de = readdir(dp)) != NULL) {
+        if (strncmp(de->d_name, "objset-0x", 9) != 0)
+            continue;
+        objset = strtoull(de->d_name + 9, &end, 16);
+        if (*end != '\0')
+            continue;
+        (*count)++;
+        if (pc == NULL)
+            continue;
+
+        (void) snprintf(path, sizeof (path), "%s/%s", dir, de->d_name);
+        if ((fd = open(path, O_RDONLY)) < 0) {
+            /* EMFILE or destroyed since the readdir() */
+            if (errno != ENOENT && complained++ % 1000 == 0)
+                fprintf(stderr, "error: cannot open %s: %s\n", path,
+                        strerror(errno));
+            continue;
+        }
+        if (pc->nobjsets == size) {
+            size = size ? size * 2 : 64;
+            pc->objsets = safe_realloc(pc->objsets,
+                                       size * sizeof (objset_kstat_t));
+        }
+        pc->objsets[pc->nobjsets].objset = objset;
+        pc->objsets[pc->nobjsets].fd = fd;
+        pc->objsets[pc->nobjsets].dataset = NULL;
+        pc->objsets[pc->nobjsets].tags = NULL;
+        pc->nobjsets++;
+    }
+    (void) closedir(dp);
+    if (pc != NULL)
+        qsort(pc->objsets, pc->nobjsets, sizeof (objset_kstat_t),
+              objset_compare);
+    return (0);
+}
+
+int
+print_datasets(pool_sample_t *sample) {
+    pool_cache_t *pc = sample->pc;
+    kstat_reader_t *k = &pc->objset;
+    objset_kstat_t *os;
+    char dir[PATH_MAX];
+    const char *name;
+    char *s;
+    size_t len;
+    uint_t count;
+    int index, first = (k->name == NULL), err = 0;
+
+    (void) kstat_path(pc->name, dir, sizeof (dir));
+    if (first) {
+        s = safe_calloc(1, strlen(pc->name) + sizeof ("/objset"));
+        (void) sprintf(s, "%s/objset", pc->name);
+        k->name = s;
+        k->prefix = "";
+        pc->objsets_stale = 1;
+    }
+    if (objsets_scan(dir, NULL, &count) != 0) {
+        /* as with the txgs, it was reported the first time */
+        if (!first)
+            return (0);
+        fprintf(stderr, "error: cannot read %s: %s\n", dir, strerror(errno));
+        return (12);
+    }
+    if (pc->objsets_stale || count != pc->nobjsets) {
+        objsets_close(pc);
+        (void) objsets_scan(dir, pc, &count);
+        pc->objsets_stale = 0;
+    }
+
+    for (uint_t i = 0; i < pc->nobjsets; i++) {
+        os = &pc->objsets[i];
+        k->fd = os->fd;
+        /* the dataset is gone, its file is left to the next scan */
+        if (kstat_read(k) != 0 || k->len == 0) {
+            pc->objsets_stale = 1;
+            continue;
+        }
+        if ((index = kstat_field_index(k, "dataset_name")) < 0 ||
+            (name = kstat_string(k, index, &len)) == NULL) {
+            err = 12;
+            continue;
+        }
+        /* a rename, or the first sample */
+        if (os->dataset == NULL || strlen(os->dataset) != len ||
+            strncmp(os->dataset, name, len) != 0) {
+            free(os->dataset);
+            free(os->tags);
+            os->dataset = safe_calloc(1, len + 1);
+            (void) memcpy(os->dataset, name, len);
+            s = escape_string(os->dataset);
+            os->tags = safe_calloc(1, strlen(pc->escaped_name) +
+                                   strlen(s) + sizeof ("name=,dataset="));
+            (void) sprintf(os->tags, "name=%s,dataset=%s", pc->escaped_name,
+                           s);
+            free(s);
+        }
+        if (kstat_print(k, sample->out, DATASET_MEASUREMENT, os->tags,
+                        sample->timestamp) != 0)
+            err = 12;
+    }
+    k->fd = -1;
+    return (err);
+}
+
+/*
+ * a file per dataset can be more than the default soft limit
+ */
+void
+raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * --record appends each pool's config to a capture file, which --replay
+ * reads back to print it again, perhaps with other options and without
+ * ZFS. The file starts with a record_file_t. Each record is a record_t,
+ * the pool name and the config packed with NV_ENCODE_XDR, padded to a
+ * multiple of 8 bytes. The headers are in the recording host's byte
+ * order, which --replay checks.
+ *
+ * A record is written with a single write() to a file opened with
+ * O_APPEND, so samples from worker threads and collector processes don't
+ * interleave.
+ */
+#define RECORD_MAGIC        "zpinflx1"
+#define RECORD_BYTE_ORDER   0x0102030405060708ULL
+
+typedef struct record_file {
+    char magic[8];
+    uint64_t byte_order;
+} record_file_t;
+
+typedef struct record {
+    uint64_t timestamp;         /* the sample's timestamp */
+    uint64_t hrtime;            /* CLOCK_MONOTONIC after the refresh */
+    uint64_t config_len;
+    uint32_t name_len;
+    uint32_t reserved;
+} record_t;
+
+#define RECORD_ALIGN(x)     (((x) + 7) & ~(uint64_t) 7)
+
+int record_fd = -1;
+int replay_paced = 0;
+
+int
+record_open(const char *path) {
+    record_file_t hdr, old;
+    struct stat st;
+
+    if ((record_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 ||
+        fstat(record_fd, &st) != 0) {
+        fprintf(stderr, "error: cannot open %s: %s\n", path,
+                strerror(errno));
+        return (1);
+    }
+    (void) memcpy(hdr.magic, RECORD_MAGIC, sizeof (hdr.magic));
+    hdr.byte_order = RECORD_BYTE_ORDER;
+    if (st.st_size == 0) {
+        if (write(record_fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
+            fprintf(stderr, "error: cannot write %s: %s\n", path,
+                    strerror(errno));
+            return (1);
+        }
+        return (0);
+    }
+    /* more samples for an existing capture */
+    if (pread(record_fd, &old, sizeof (old), 0) != sizeof (old) ||
+        memcmp(&old, &hdr, sizeof (hdr)) != 0) {
+        fprintf(stderr, "error: %s is not a capture from this host type\n",
+                path);
+        return (1);
+    }
+    return (0);
+}
+
+/*
+ * a failed record is reported, but the sample is still printed
+ */
+void
+record_config(pool_sample_t *sample, const char *name, nvlist_t *config) {
+    static int complained = 0;
+    record_t rec;
+    char *packed = NULL, *buf;
+    size_t packed_len, len;
+    ssize_t n;
+
+    if (nvlist_pack(config, &packed, &packed_len, NV_ENCODE_XDR, 0) != 0) {
+        if (complained++ % 1000 == 0)
+            fprintf(stderr, "error: cannot pack the config of %s\n", name);
+        return;
+    }
+    (void) memset(&rec, 0, sizeof (rec));
+    rec.timestamp = sample->timestamp;
+    rec.hrtime = sample->hrtime;
+    rec.config_len = packed_len;
+    rec.name_len = (uint32_t) strlen(name);
+    len = RECORD_ALIGN(sizeof (rec) + rec.name_len + packed_len);
+    buf = safe_calloc(1, len);
+    (void) memcpy(buf, &rec, sizeof (rec));
+    (void) memcpy(buf + sizeof (rec), name, rec.name_len);
+    (void) memcpy(buf + sizeof (rec) + rec.name_len, packed, packed_len);
+    free(packed);
+
+    while ((n = write(record_fd, buf, len)) < 0 && errno == EINTR)
+        continue;
+    if (n != (ssize_t) len && complained++ % 1000 == 0) {
+        fprintf(stderr, "error: cannot record the sample of %s: %s\n", name,
+                n < 0 ? strerror(errno) : "short write");
+    }
+    free(buf);
+}
+
+/*
+ * format a pool's config into sample->out, for a live pool or a --replay
+ */
+int
+sample_config(pool_sample_t *sample, const char *name, nvlist_t *config) {
+	uint_t c, enabled;
+	int err;
+	nvlist_t *nvroot;
+	vdev_stat_t *vs;
+	lp_writer_t *out = sample->out;
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	uint64_t lines = out->lines, bytes = out->bytes + out->len;
+
+	if (nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &nvroot) != 0)
+		return (2);
+	if (nvlist_lookup_uint64_array(nvroot, ZPOOL_CONFIG_VDEV_STATS,
+	        (uint64_t **) &vs, &c) != 0) {
+		return (3);
+	}
+
+	sample->pc = pool_cache_get(name, config);
+	sample->vdevs = 0;
+	/* an event's sample leaves the pool's part of the --shm snapshot be */
+	if (!sample->event)
+		sample->pc->shm_n = 0;
+    enabled = 0;
+    for (int i = 0; vdev_printers[i].func; i++) {
+        /* after an event, only zpool_stats, the rest wait for the interval */
+        if (sample->event) {
+            if (vdev_printers[i].func == print_summary_stats)
+                enabled |= 1U << i;
+            continue;
+        }
+        if (select_given && (select_printers & (1U << i)) == 0)
+            continue;
+        if (no_histograms == 0 || vdev_printers[i].histogram == 0 ||
+            (vdev_printers[i].also != NULL && *vdev_printers[i].also))
+            enabled |= 1U << i;
+    }
+    if (top_leaves != 0 && !sample->event)
+        pick_top_leaves(sample, nvroot);
+	/* if any of these return an error, skip the rest */
+    err = walk_vdev_tree(sample, nvroot, NULL, 0, enabled, 0);
+    if (err == 0)
+        err = print_scan_status(sample, nvroot);
+    if (err == 0 && queue_sample_ns != 0 && !sample->event)
+        err = print_queue_depth(sample, nvroot);
+    if (internal_stats && !sample->event)
+        print_internal_pool_stats(sample, start, lines, bytes);
+    return (err);
+}
+
+/*
+ * refresh a pool's stats and format them into out, or with event set only
+ * its zpool_stats and zpool_scan_stats
+ *
+ * Returns 9 if the refresh failed, which is the only error that calls for
+ * a new pool handle.
+ *
+ * Note: if the pool is broken, this can hang indefinitely and perhaps in an
+ * unkillable state.
+ */
+int
+sample_pool(zpool_handle_t *zhp, lp_writer_t *out, int event) {
+	int err;
+	nvlist_t *config;
+	struct timespec tv;
+	pool_sample_t sample;
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+
+	if ((config = pool_refresh(zhp)) == NULL)
+		return (9);
+	sample.hrtime = clock_ns(CLOCK_MONOTONIC);
+	sample.refresh_time = sample.hrtime - start;
+
+	if (sample_time != 0)
+		sample.timestamp = sample_time;
+	else if (clock_gettime(CLOCK_REALTIME, &tv) != 0)
+		sample.timestamp = (uint64_t) time(NULL) * 1000000000;
+	else
+		sample.timestamp =
+		    ((uint64_t) tv.tv_sec * 1000000000) + (uint64_t) tv.tv_nsec;
+
+	sample.out = out;
+	sample.event = event;
+	if (event)
+		return (sample_config(&sample, zhp->zpool_name, config));
+	if (record_fd >= 0)
+		record_config(&sample, zhp->zpool_name, config);
+	err = sample_config(&sample, zhp->zpool_name, config);
+	if (err == 0 && txg_history)
+		err = print_txgs(&sample);
+	if (err == 0 && dataset_stats)
+		err = print_datasets(&sample);
+	return (err);
+}
+
+/*
+ * print the stats from the pool config
+ */
+int
+print_stats(zpool_handle_t *zhp) {
+    int err;
+
+    err = sample_pool(zhp, &output_writer, 0);
+
+    /* one write per pool, even if some of it failed */
+    if (lp_flush(&output_writer) != 0 && err == 0)
+        err = 7;
+    return (err);
+}
+
+/*
+ * --include and --exclude: which pools to sample, by shell glob. A pool
+ * is sampled if it matches one of the --include globs, or there are none,
+ * and none of the --exclude globs.
+ */
+typedef struct glob_list {
+    char **globs;
+    uint_t n;
+} glob_list_t;
+
+glob_list_t pool_include, pool_exclude;
+
+/*
+ * add a comma separated list of globs, pool names can't have commas
+ */
+void
+glob_list_add(glob_list_t *l, char *arg) {
+    char *glob, *last;
+
+    for (glob = strtok_r(arg, ",", &last); glob != NULL;
+         glob = strtok_r(NULL, ",", &last)) {
+        l->globs = safe_realloc(l->globs, (l->n + 1) * sizeof (char *));
+        l->globs[l->n++] = glob;
+    }
+}
+
+int
+glob_list_match(glob_list_t *l, const char *name) {
+    for (uint_t i = 0; i < l->n; i++) {
+        if (fnmatch(l->globs[i], name, 0) == 0)
+            return (1);
+    }
+    return (0);
+}
+
+/*
+ * is the pool wanted, by the pool name argument and the glob lists
+ */
+int
+pool_wanted(const char *name, const char *pool_name) {
+    if (pool_name != NULL &&
+        strncmp(pool_name, name, ZFS_MAX_DATASET_NAME_LEN) != 0)
+        return (0);
+    if (pool_include.n != 0 && !glob_list_match(&pool_include, name))
+        return (0);
+    return (!glob_list_match(&pool_exclude, name));
+}
+
+/*
+ * The pool handles are kept from one sample to the next, rather than
+ * having zpool_iter() open every pool and close it again each time. Each
+ * imported pool has a directory under spl/kstat/zfs, so reading that is
+ * enough to tell when pools come and go. When the names change, or the
+ * refresh of a pool failed, the handles are opened again, and only for the
+ * pools that are wanted. Without the kstats, zpool_iter() opens them all
+ * on every sample, as before.
+ */
+typedef struct pool_handles {
+    zpool_handle_t **zhp;
+    uint_t n;
+    uint_t size;
+    lp_writer_t names;          /* NUL separated, they were opened from */
+    lp_writer_t scratch;        /* for the names read this time */
+    int stale;                  /* open them again */
+} pool_handles_t;
+
+pool_handles_t pool_handles;
+
+int
+pool_name_compare(const void *a, const void *b) {
+    return (strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+/*
+ * the names of the imported pools, sorted and NUL separated into w
+ */
+int
+pool_names_list(lp_writer_t *w) {
+    static char **names = NULL;
+    static uint_t size = 0;
+    char dir[PATH_MAX], path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    uint_t n = 0;
+    DIR *dp;
+
+    (void) kstat_path("", dir, sizeof (dir));
+    if ((dp = opendir(dir)) == NULL)
+        return (1);
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (de->d_type == DT_UNKNOWN) {
+            /* a path too long for PATH_MAX is no pool's */
+            if (snprintf(path, sizeof (path), "%s/%s", dir,
+                         de->d_name) >= (int) sizeof (path) ||
+                stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+                continue;
+        } else if (de->d_type != DT_DIR) {
+            continue;
+        }
+        if (n == size) {
+            size = size ? size * 2 : 16;
+            names = safe_realloc(names, size * sizeof (char *));
+        }
+        names[n++] = safe_strdup(de->d_name);
+    }
+    (void) closedir(dp);
+
+    /* in the order zpool_iter() would have them */
+    qsort(names, n, sizeof (char *), pool_name_compare);
+    w->len = 0;
+    for (uint_t i = 0; i < n; i++) {
+        lp_puts(w, names[i]);
+        lp_putc(w, '\0');
+        free(names[i]);
+    }
+    return (0);
+}
+
+void
+pool_handles_add(zpool_handle_t *zhp) {
+    pool_handles_t *ph = &pool_handles;
+
+    if (ph->n == ph->size) {
+        ph->size = ph->size ? ph->size * 2 : 16;
+        ph->zhp = safe_realloc(ph->zhp, ph->size * sizeof (zpool_handle_t *));
+    }
+    ph->zhp[ph->n++] = zhp;
+}
+
+/*
+ * zpool_iter() call-back, without the kstats
+ */
+int
+pool_handles_iter(zpool_handle_t *zhp, void *data) {
+    if (pool_wanted(zhp->zpool_name, data))
+        pool_handles_add(zhp);
+    else
+        zpool_close(zhp);
+    return (0);
+}
+
+/*
+ * bring the handles up to date for this sample
+ */
+int
+pool_handles_update(libzfs_handle_t *g_zfs, char *pool_name) {
+    pool_handles_t *ph = &pool_handles;
+    lp_writer_t tmp;
+    zpool_handle_t *zhp;
+    char *name, *end;
+    int listed;
+
+    if (ph->names.buf == NULL) {
+        lp_init(&ph->names, NULL, NULL);
+        lp_init(&ph->scratch, NULL, NULL);
+        ph->stale = 1;
+    }
+    listed = pool_names_list(&ph->scratch) == 0;
+    if (listed && !ph->stale && ph->scratch.len == ph->names.len &&
+        memcmp(ph->scratch.buf, ph->names.buf, ph->names.len) == 0)
+        return (0);
+
+    for (uint_t i = 0; i < ph->n; i++)
+        zpool_close(ph->zhp[i]);
+    ph->n = 0;
+    if (!listed) {
+        /* zpool_iter() again next time, too */
+        ph->stale = 1;
+        return (zpool_iter(g_zfs, pool_handles_iter, pool_name));
+    }
+
+    tmp = ph->names;
+    ph->names = ph->scratch;
+    ph->scratch = tmp;
+    ph->stale = 0;
+    name = ph->names.buf;
+    end = name + ph->names.len;
+    for (; name < end; name += strlen(name) + 1) {
+        if (!pool_wanted(name, pool_name))
+            continue;
+        /* gone since the kstats were read, or still being imported */
+        if ((zhp = zpool_open_canfail(g_zfs, name)) != NULL)
+            pool_handles_add(zhp);
+    }
+    return (0);
+}
+
+zpool_handle_t *
+pool_handles_find(const char *name) {
+    for (uint_t i = 0; i < pool_handles.n; i++) {
+        if (strcmp(pool_handles.zhp[i]->zpool_name, name) == 0)
+            return (pool_handles.zhp[i]);
+    }
+    return (NULL);
+}
+
+/*
+ * sample the pools one after the other
+ */
+int
+sample_pools_serial(libzfs_handle_t *g_zfs, char *pool_name) {
+    int ret, err;
+
+    ret = pool_handles_update(g_zfs, pool_name);
+    for (uint_t i = 0; i < pool_handles.n; i++) {
+        if ((err = print_stats(pool_handles.zhp[i])) != 0) {
+            /* exported or broken, start over with fresh handles */
+            if (err == 9)
+                pool_handles.stale = 1;
+            if (ret == 0)
+                ret = err;
+        }
+    }
+    return (ret);
+}
+
+/*
+ * print the samples in a --record capture, as fast as possible or, with
+ * --paced, as far apart as they were recorded
+ */
+int
+replay(const char *path, char *pool_name) {
+    record_file_t *hdr;
+    record_t rec;
+    pool_sample_t sample;
+    nvlist_t *config;
+    struct stat st;
+    struct timespec ts;
+    char *map, *p, *end;
+    char name[ZFS_MAX_DATASET_NAME_LEN];
+    uint64_t first = 0, start = 0, deadline;
+    int fd, err, ret = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "error: cannot open %s: %s\n", path,
+                strerror(errno));
+        return (1);
+    }
+    if ((size_t) st.st_size < sizeof (*hdr) ||
+        (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                    0)) == MAP_FAILED) {
+        fprintf(stderr, "error: cannot read %s\n", path);
+        (void) close(fd);
+        return (1);
+    }
+    (void) close(fd);
+    hdr = (record_file_t *) map;
+    if (memcmp(hdr->magic, RECORD_MAGIC, sizeof (hdr->magic)) != 0 ||
+        hdr->byte_order != RECORD_BYTE_ORDER) {
+        fprintf(stderr, "error: %s is not a capture from this host type\n",
+                path);
+        (void) munmap(map, (size_t) st.st_size);
+        return (1);
+    }
+
+    end = map + st.st_size;
+    for (p = map + sizeof (*hdr); p < end;
+         p += RECORD_ALIGN(sizeof (rec) + rec.name_len + rec.config_len)) {
+        /* a recorder that was killed can leave a partial record */
+        if ((size_t) (end - p) < sizeof (rec)) {
+            fprintf(stderr, "error: %s is truncated\n", path);
+            ret = 1;
+            break;
+        }
+        (void) memcpy(&rec, p, sizeof (rec));
+        if (rec.name_len >= sizeof (name) ||
+            rec.name_len > (size_t) (end - p) - sizeof (rec) ||
+            rec.config_len > (uint64_t) (end - p) - sizeof (rec) -
+            rec.name_len) {
+            fprintf(stderr, "error: %s is truncated\n", path);
+            ret = 1;
+            break;
+        }
+        (void) memcpy(name, p + sizeof (rec), rec.name_len);
+        name[rec.name_len] = '\0';
+        if (pool_name != NULL && strcmp(pool_name, name) != 0)
+            continue;
+
+        if (replay_paced) {
+            if (start == 0) {
+                start = clock_ns(CLOCK_MONOTONIC);
+                first = rec.hrtime;
+            }
+            deadline = start + (rec.hrtime > first ? rec.hrtime - first : 0);
+            ts.tv_sec = (time_t) (deadline / 1000000000);
+            ts.tv_nsec = (long) (deadline % 1000000000);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                   NULL) == EINTR)
+                continue;
+        }
+
+        if (nvlist_unpack(p + sizeof (rec) + rec.name_len,
+                          (size_t) rec.config_len, &config, 0) != 0) {
+            fprintf(stderr, "error: cannot unpack the config of %s\n", name);
+            ret = 1;
+            continue;
+        }
+        sample.out = &output_writer;
+        sample.timestamp = rec.timestamp;
+        sample.hrtime = rec.hrtime;
+        sample.refresh_time = 0;
+        sample.event = 0;
+        err = sample_config(&sample, name, config);
+        nvlist_free(config);
+        if (lp_flush(&output_writer) != 0 && err == 0)
+            err = 7;
+        if (output_flush(0) != 0 && err == 0)
+            err = 7;
+        if (ret == 0)
+            ret = err;
+    }
+    (void) munmap(map, (size_t) st.st_size);
+    return (ret);
+}
+
+/*
+ * Parallel collection
+ *
+ * With --threads, the pools are refreshed and formatted concurrently by a
+ * pool of worker threads that lives for the life of the process. Each pool
+ * is formatted into its own buffer and the buffers are written out in
+ * pool order once every pool is done, so the output looks the same as the
+ * serial case, but a slow pool no longer delays the pools after it.
+ *
+ * libzfs makes no promises about sharing a libzfs_handle_t between
+ * threads, so each worker has its own. The zpool handles it is given are
+ * pointed at it for the job and back at the main thread's afterwards, as
+ * they are kept and used between the rounds.
+ */
+typedef struct pool_job {
+    zpool_handle_t *zhp;
+    lp_writer_t out;
+    int err;
+} pool_job_t;
+
+typedef struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;     /* a round of jobs is ready */
+    pthread_cond_t done_cv;     /* the last job of the round finished */
+    pool_job_t *jobs;
+    uint_t njobs;
+    uint_t maxjobs;
+    uint_t next;                /* next job to hand out */
+    uint_t ndone;
+    uint64_t round;
+} worker_pool_t;
+
+worker_pool_t workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cv = PTHREAD_COND_INITIALIZER,
+    .done_cv = PTHREAD_COND_INITIALIZER,
+};
+int nthreads = 0;
+
+void *
+worker_main(void *arg) {
+    libzfs_handle_t *hdl, *main_hdl;
+    uint64_t round = 0;
+    pool_job_t *job;
+
+    if ((hdl = libzfs_init()) == NULL) {
+        fprintf(stderr, "error: cannot initialize libzfs in worker\n");
+        exit(EXIT_FAILURE);
+    }
+
+    (void) pthread_mutex_lock(&workers.lock);
+    for (;;) {
+        while (workers.round == round || workers.next >= workers.njobs) {
+            round = workers.round;
+            (void) pthread_cond_wait(&workers.work_cv, &workers.lock);
+        }
+        job = &workers.jobs[workers.next++];
+        (void) pthread_mutex_unlock(&workers.lock);
+
+        main_hdl = job->zhp->zpool_hdl;
+        job->zhp->zpool_hdl = hdl;
+        job->err = sample_pool(job->zhp, &job->out, 0);
+        job->zhp->zpool_hdl = main_hdl;
+
+        (void) pthread_mutex_lock(&workers.lock);
+        if (++workers.ndone == workers.njobs)
+            (void) pthread_cond_signal(&workers.done_cv);
+    }
+    return (NULL);
+}
+
+void
+start_workers(void) {
+    pthread_t tid;
+    int err;
+
+    for (int i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&tid, NULL, worker_main, NULL)) != 0) {
+            fprintf(stderr, "error: cannot create worker thread: %s\n",
+                    strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        (void) pthread_detach(tid);
+    }
+}
+
+/*
+ * queue a pool for the workers, with workers.lock held
+ */
+void
+queue_pool(zpool_handle_t *zhp) {
+    pool_job_t *job;
+
+    if (workers.njobs == workers.maxjobs) {
+        workers.maxjobs = workers.maxjobs ? workers.maxjobs * 2 : 16;
+        workers.jobs = safe_realloc(workers.jobs,
+                                    workers.maxjobs * sizeof (pool_job_t));
+        /* the job buffers are kept from one sample to the next */
+        for (uint_t i = workers.njobs; i < workers.maxjobs; i++)
+            lp_init(&workers.jobs[i].out, NULL, NULL);
+    }
+    job = &workers.jobs[workers.njobs++];
+    job->zhp = zhp;
+    job->err = 0;
+}
+
+/*
+ * sample the pools on the worker threads and write their output in order
+ */
+int
+sample_pools_parallel(libzfs_handle_t *g_zfs, char *pool_name) {
+    int ret;
+
+    ret = pool_handles_update(g_zfs, pool_name);
+
+    /* the workers are idle, but one that wakes up reads the job list */
+    (void) pthread_mutex_lock(&workers.lock);
+    workers.njobs = 0;
+    for (uint_t i = 0; i < pool_handles.n; i++)
+        queue_pool(pool_handles.zhp[i]);
+    workers.next = 0;
+    workers.ndone = 0;
+    workers.round++;
+    (void) pthread_cond_broadcast(&workers.work_cv);
+    while (workers.ndone < workers.njobs)
+        (void) pthread_cond_wait(&workers.done_cv, &workers.lock);
+    (void) pthread_mutex_unlock(&workers.lock);
+
+    for (uint_t i = 0; i < workers.njobs; i++) {
+        pool_job_t *job = &workers.jobs[i];
+
+        job->out.sink = output_writer.sink;
+        job->out.sink_arg = output_writer.sink_arg;
+        if (lp_flush(&job->out) != 0 && job->err == 0)
+            job->err = 7;
+        job->out.sink = NULL;
+        /* the first error wins, and a failed refresh reopens the handles */
+        if (job->err == 9)
+            pool_handles.stale = 1;
+        if (job->err != 0 && ret == 0)
+            ret = job->err;
+    }
+    return (ret);
+}
+
+/*
+ * Supervised collection
+ *
+ * With --pool-timeout, the pools are sampled in child processes so that a
+ * pool which hangs in the kernel can't stall the samples of the others.
+ * Each pool has a long-lived child that keeps its own pool handle and
+ * caches. A child that misses the deadline is left to finish, or not, in
+ * its own time: it gets no new requests until it answers, its pool is
+ * reported as timed out in zpool_collector_health, and the late answer is
+ * thrown away. A child stuck in the kernel can't be killed anyway, and
+ * leaving it be means there is never more than one process per pool, no
+ * matter how long the pool stays sick.
+ *
+ * Finding the pools also opens each of them, which can hang the same way,
+ * so that happens in a child, too. When it misses the deadline, the pools
+ * found by the last discovery that did finish are sampled.
+ */
+typedef struct collector_req {
+    uint64_t seq;
+    uint64_t timestamp;         /* 0 to use the time of the refresh */
+} collector_req_t;
+
+typedef struct collector_reply {
+    uint64_t seq;
+    uint64_t len;               /* of the payload that follows */
+    int64_t err;
+} collector_reply_t;
+
+#define COLLECTOR_EXITED    9   /* error codes for the pool's health */
+#define COLLECTOR_TIMEOUT   10
+
+typedef struct collector {
+    struct collector *next;
+    char name[ZFS_MAX_DATASET_NAME_LEN];    /* "" for discovery */
+    char *escaped_name;
+    pid_t pid;                  /* 0 if there is no child */
+    int req_fd;
+    int reply_fd;
+    uint64_t seq;               /* outstanding request, 0 if idle */
+    uint64_t asked;             /* this round's request, 0 if none */
+    uint64_t sent;              /* when the request was sent */
+    uint64_t answered;          /* and when it was answered */
+    collector_reply_t hdr;
+    size_t got;                 /* bytes of hdr and payload read */
+    lp_writer_t reply;
+    int done;                   /* answered this round's request */
+    int found;                  /* in the last discovery */
+    uint64_t timeouts;          /* consecutive samples timed out */
+} collector_t;
+
+uint64_t pool_timeout_ns = 0;
+uint64_t collector_seq = 0;
+collector_t discovery;
+collector_t *collectors = NULL;
+
+/*
+ * zpool_iter() call-back for the discovery child, the pool names are
+ * returned NUL separated
+ */
+int
+discover_pool(zpool_handle_t *zhp, void *data) {
+    lp_writer_t *out = data;
+
+    lp_puts(out, zhp->zpool_name);
+    lp_putc(out, '\0');
+    zpool_close(zhp);
+    return (0);
+}
+
+int
+read_full(int fd, void *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return (-1);
+        buf = (char *) buf + n;
+        len -= (size_t) n;
+    }
+    return (0);
+}
+
+void
+collector_main(collector_t *c, libzfs_handle_t *g_zfs) {
+    zpool_handle_t *zhp = NULL;
+    collector_req_t req;
+    collector_reply_t hdr;
+    lp_writer_t out;
+    int err;
+
+    lp_init(&out, NULL, NULL);
+    while (read_full(c->req_fd, &req, sizeof (req)) == 0) {
+        out.len = 0;
+        sample_time = req.timestamp;
+        if (c->name[0] == '\0') {
+            /* the kstats don't need the pools to be opened */
+            err = pool_names_list(&out) == 0 ? 0 :
+                zpool_iter(g_zfs, discover_pool, &out);
+        } else {
+            if (zhp == NULL)
+                zhp = zpool_open_canfail(g_zfs, c->name);
+            err = zhp != NULL ? sample_pool(zhp, &out, 0) : 1;
+            /* start over with a fresh handle next time */
+            if (err == 9) {
+                zpool_close(zhp);
+                zhp = NULL;
+            }
+        }
+        hdr.seq = req.seq;
+        hdr.len = out.len;
+        hdr.err = err;
+        if (lp_sink_fd((char *) &hdr, sizeof (hdr), &c->reply_fd) != 0 ||
+            lp_sink_fd(out.buf, out.len, &c->reply_fd) != 0)
+            break;
+    }
+    _exit(0);
+}
+
+void
+collector_close(collector_t *c) {
+    if (c->pid == 0)
+        return;
+    (void) close(c->req_fd);
+    (void) close(c->reply_fd);
+    /* an idle child exits on EOF, a hung one is reaped when it wakes */
+    (void) waitpid(c->pid, NULL, WNOHANG);
+    c->pid = 0;
+    c->seq = 0;
+}
+
+int
+collector_spawn(collector_t *c, libzfs_handle_t *g_zfs) {
+    int req[2], reply[2];
+    collector_t *o;
+
+    if (pipe(req) != 0)
+        goto fail;
+    if (pipe(reply) != 0) {
+        (void) close(req[0]);
+        (void) close(req[1]);
+        goto fail;
+    }
+    if ((c->pid = fork()) < 0) {
+        c->pid = 0;
+        (void) close(req[0]);
+        (void) close(req[1]);
+        (void) close(reply[0]);
+        (void) close(reply[1]);
+        goto fail;
+    }
+    if (c->pid == 0) {
+        /* the connection and other children's pipes aren't ours */
+        net_close(&net_out);
+        if (prom_listen_fd >= 0)
+            (void) close(prom_listen_fd);
+        if (discovery.pid != 0 && &discovery != c) {
+            (void) close(discovery.req_fd);
+            (void) close(discovery.reply_fd);
+        }
+        for (o = collectors; o != NULL; o = o->next) {
+            if (o->pid != 0 && o != c) {
+                (void) close(o->req_fd);
+                (void) close(o->reply_fd);
+            }
+        }
+        (void) close(req[1]);
+        (void) close(reply[0]);
+        c->req_fd = req[0];
+        c->reply_fd = reply[1];
+        collector_main(c, g_zfs);
+    }
+    (void) close(req[0]);
+    (void) close(reply[1]);
+    c->req_fd = req[1];
+    c->reply_fd = reply[0];
+    (void) fcntl(c->reply_fd, F_SETFL, O_NONBLOCK);
+    c->seq = 0;
+    return (0);
+fail:
+    fprintf(stderr, "error: cannot start collector for %s: %s\n",
+            c->name[0] ? c->name : "pool discovery", strerror(errno));
+    return (1);
+}
+
+/*
+ * read what the child has sent so far, returns non-zero once it's all in
+ * or the child has gone away
+ */
+int
+collector_read(collector_t *c) {
+    ssize_t n;
+    size_t want;
+    char *dst;
+
+    for (;;) {
+        if (c->got < sizeof (c->hdr)) {
+            dst = (char *) &c->hdr + c->got;
+            want = sizeof (c->hdr) - c->got;
+        } else {
+            want = c->hdr.len - c->reply.len;
+            if (want == 0)
+                break;
+            lp_reserve(&c->reply, want);
+            dst = c->reply.buf + c->reply.len;
+        }
+        if ((n = read(c->reply_fd, dst, want)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return (0);
+        }
+        if (n <= 0) {
+            collector_close(c);
+            return (1);
+        }
+        if (c->got < sizeof (c->hdr))
+            c->got += (size_t) n;
+        else
+            c->reply.len += (size_t) n;
+    }
+
+    if (c->hdr.seq == c->asked) {
+        c->done = 1;
+        c->answered = clock_ns(CLOCK_MONOTONIC);
+    } else {
+        c->reply.len = 0;   /* a late answer to a request that timed out */
+    }
+    c->seq = 0;
+    c->got = 0;
+    return (1);
+}
+
+/*
+ * send this round's request, unless the child is still busy with an
+ * earlier one
  */
-int
-print_vdev_size_stats(nvlist_t *nvroot, const char *pool_name,
-                      const char *parent_name) {
-    uint_t c, end = 0;
-    nvlist_t *nv_ex;
-    char *vdev_desc = NULL;
-
-    /* short_names become the field name */
-    struct size_lookup {
-        char *name;
-        char *short_name;
-        uint64_t sum;
-        uint64_t *array;
-    };
-    struct size_lookup size_type[] = {
-        {ZPOOL_CONFIG_VDEV_SYNC_IND_R_HISTO,   "sync_read_ind"},
-        {ZPOOL_CONFIG_VDEV_SYNC_IND_W_HISTO,   "sync_write_ind"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_IND_R_HISTO,  "async_read_ind"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_IND_W_HISTO,  "async_write_ind"},
-        {ZPOOL_CONFIG_VDEV_IND_SCRUB_HISTO,    "scrub_read_ind"},
-        {ZPOOL_CONFIG_VDEV_SYNC_AGG_R_HISTO,   "sync_read_agg"},
-        {ZPOOL_CONFIG_VDEV_SYNC_AGG_W_HISTO,   "sync_write_agg"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_AGG_R_HISTO,  "async_read_agg"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_AGG_W_HISTO,  "async_write_agg"},
-        {ZPOOL_CONFIG_VDEV_AGG_SCRUB_HISTO,    "scrub_read_agg"},
-#ifdef ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO
-        {ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO,    "trim_write_ind"},
-            {ZPOOL_CONFIG_VDEV_AGG_TRIM_HISTO,    "trim_write_agg"},
-#endif
-        {NULL,                                NULL}
-    };
+void
+collector_request(collector_t *c, libzfs_handle_t *g_zfs, uint64_t ts) {
+    collector_req_t req;
 
-    if (nvlist_lookup_nvlist(nvroot,
-                             ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-        return (6);
+    c->done = 0;
+    c->asked = 0;
+    if (c->pid == 0 && collector_spawn(c, g_zfs) != 0)
+        return;
+    /* it may have finished with a request that timed out */
+    if (c->seq != 0)
+        (void) collector_read(c);
+    if (c->pid == 0 || c->seq != 0)
+        return;
+    req.seq = ++collector_seq;
+    req.timestamp = ts;
+    if (lp_sink_fd((char *) &req, sizeof (req), &c->req_fd) != 0) {
+        collector_close(c);
+        return;
     }
+    c->seq = c->asked = req.seq;
+    c->sent = clock_ns(CLOCK_MONOTONIC);
+    c->got = 0;
+    c->reply.len = 0;
+}
 
-    vdev_desc = get_vdev_desc(nvroot, parent_name);
+/*
+ * wait for the children that have a request outstanding, until the ones
+ * asked this round have answered or the deadline passes
+ */
+void
+collector_wait(collector_t *list, uint64_t deadline) {
+    static struct pollfd *pfd = NULL;
+    static collector_t **polled = NULL;
+    static size_t npfd = 0;
+    collector_t *c;
+    uint64_t now;
+    size_t n;
+    int waiting;
 
-    for (int i = 0; size_type[i].name; i++) {
-        if (nvlist_lookup_uint64_array(nv_ex,
-                                       size_type[i].name,
-                                       &size_type[i].array,
-                                       &c) != 0) {
-            fprintf(stderr, "error: can't get %s\n", size_type[i].name);
-            return (3);
+    for (;;) {
+        n = 0;
+        waiting = 0;
+        for (c = list; c != NULL; c = c->next) {
+            if (c->pid == 0 || c->seq == 0)
+                continue;
+            if (n == npfd) {
+                npfd = npfd ? npfd * 2 : 16;
+                pfd = safe_realloc(pfd, npfd * sizeof (*pfd));
+                polled = safe_realloc(polled, npfd * sizeof (*polled));
+            }
+            pfd[n].fd = c->reply_fd;
+            pfd[n].events = POLLIN;
+            polled[n++] = c;
+            if (c->seq == c->asked)
+                waiting++;
+        }
+        now = clock_ns(CLOCK_MONOTONIC);
+        if (waiting == 0 || now >= deadline)
+            return;
+        if (poll(pfd, n, (int) ((deadline - now + 999999) / 1000000)) < 0 &&
+            errno != EINTR)
+            return;
+        for (size_t i = 0; i < n; i++) {
+            if (pfd[i].revents != 0)
+                (void) collector_read(polled[i]);
         }
-        /* end count count, all of the arrays are the same size */
-        end = c - 1;
-    }
-
-   for (int bucket = 0; bucket <= end; bucket++) {
-       if (bucket < MIN_SIZE_INDEX) {
-           /* don't print, but collect the sum */
-           for (int i = 0; size_type[i].name; i++) {
-               size_type[i].sum += size_type[i].array[bucket];
-           }
-           continue;
-       }
-
-       if (bucket < end) {
-            printf("%s,le=%llu,name=%s,%s ",
-                   POOL_IO_SIZE_MEASUREMENT, 1ULL << bucket,
-                   pool_name, vdev_desc);
-       } else {
-           printf("%s,le=+Inf,name=%s,%s ",
-                  POOL_IO_SIZE_MEASUREMENT, pool_name, vdev_desc);
-       }
-       for (int i = 0; size_type[i].name; i++) {
-           if (bucket <= MIN_SIZE_INDEX || sum_histogram_buckets) {
-               size_type[i].sum += size_type[i].array[bucket];
-           } else {
-               size_type[i].sum = size_type[i].array[bucket];
-           }
-           printf("%s="IFMT, size_type[i].short_name, size_type[i].sum);
-           if (size_type[i + 1].name != NULL) {
-               printf(",");
-           }
-       }
-       printf(" %lu\n", timestamp);
     }
-    return (0);
+}
+
+collector_t *
+collector_get(const char *name) {
+    collector_t *c;
+
+    for (c = collectors; c != NULL; c = c->next) {
+        if (strcmp(c->name, name) == 0)
+            return (c);
+    }
+    c = safe_calloc(1, sizeof (*c));
+    (void) strncpy(c->name, name, sizeof (c->name));
+    c->name[sizeof (c->name) - 1] = '\0';
+    c->escaped_name = escape_string(c->name);
+    lp_init(&c->reply, NULL, NULL);
+    c->next = collectors;
+    collectors = c;
+    return (c);
 }
 
 /*
- * ZIO scheduler queue stats are stored as gauges. This is unfortunate
- * because the values can change very rapidly and any point-in-time
- * value will quickly be obsoleted. It is also not easy to downsample.
- * Thus only the top-level queue stats might be beneficial... maybe.
+ * ask the discovery child for the pool names, and rebuild the collector
+ * list in that order, or keep the old list if it doesn't answer in time
  */
-int
-print_queue_stats(nvlist_t *nvroot, const char *pool_name,
-                  const char *parent_name) {
-    nvlist_t *nv_ex;
-    uint64_t value;
+void
+discover_pools(libzfs_handle_t *g_zfs) {
+    static int complained = 0;
+    collector_t *c, **pp, *list = NULL, **tail = &list;
+    char *name, *end;
 
-    /* short_names are used for the field name */
-    struct queue_lookup {
-        char *name;
-        char *short_name;
-    };
-    struct queue_lookup queue_type[] = {
-        {ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,  "sync_r_active"},
-        {ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,  "sync_w_active"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active"},
-        {ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,  "async_scrub_active"},
-        {ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,    "sync_r_pend"},
-        {ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,    "sync_w_pend"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,   "async_r_pend"},
-        {ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,   "async_w_pend"},
-        {ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,     "async_scrub_pend"},
-        {NULL,                                   NULL}
-    };
+    if (discovery.reply.buf == NULL)
+        lp_init(&discovery.reply, NULL, NULL);
+    collector_request(&discovery, g_zfs, 0);
+    collector_wait(&discovery, clock_ns(CLOCK_MONOTONIC) + pool_timeout_ns);
+    if (!discovery.done || discovery.hdr.err != 0) {
+        if (!complained++)
+            fprintf(stderr, "error: pool discovery did not finish, "
+                            "sampling the pools found before\n");
+        return;
+    }
+    complained = 0;
 
-    if (nvlist_lookup_nvlist(nvroot,
-                             ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-        return (6);
+    for (c = collectors; c != NULL; c = c->next)
+        c->found = 0;
+    name = discovery.reply.buf;
+    end = name + discovery.reply.len;
+    for (; name < end; name += strlen(name) + 1) {
+        if (!pool_wanted(name, NULL))
+            continue;
+        c = collector_get(name);
+        if (c->found)
+            continue;
+        c->found = 1;
+        /* unlink it and append it to the list in discovery order */
+        for (pp = &collectors; *pp != c; pp = &(*pp)->next)
+            ;
+        *pp = c->next;
+        c->next = NULL;
+        *tail = c;
+        tail = &c->next;
     }
 
-    printf("%s,name=%s,%s ",
-           POOL_QUEUE_MEASUREMENT, pool_name,
-           get_vdev_desc(nvroot, parent_name));
-    for (int i = 0; queue_type[i].name; i++) {
-        if (nvlist_lookup_uint64(nv_ex,
-                                 queue_type[i].name, &value) != 0) {
-            fprintf(stderr, "error: can't get %s\n",
-                    queue_type[i].name);
-            return (3);
-        }
-        printf("%s="IFMT, queue_type[i].short_name, value);
-        if (queue_type[i + 1].name != NULL) {
-            printf(",");
-        }
+    /* the rest are exported or destroyed */
+    while ((c = collectors) != NULL) {
+        collectors = c->next;
+        collector_close(c);
+        free(c->reply.buf);
+        free(c->escaped_name);
+        free(c);
     }
-    printf(" %lu\n", timestamp);
-    return (0);
+    collectors = list;
 }
 
 /*
- * top-level vdev stats are at the pool level
+ * sample the pools in their collector processes
  */
 int
-print_top_level_vdev_stats(nvlist_t *nvroot, const char *pool_name) {
-	nvlist_t *nv_ex;
-	uint64_t value;
-
-	/* short_names become part of the metric name */
-	struct queue_lookup {
-	    char *name;
-	    char *short_name;
-	};
-	struct queue_lookup queue_type[] = {
-	    {ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE, "sync_r_active_queue"},
-	    {ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE, "sync_w_active_queue"},
-	    {ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active_queue"},
-	    {ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active_queue"},
-	    {ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE, "async_scrub_active_queue"},
-	    {ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE, "sync_r_pend_queue"},
-	    {ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE, "sync_w_pend_queue"},
-	    {ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE, "async_r_pend_queue"},
-	    {ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE, "async_w_pend_queue"},
-	    {ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE, "async_scrub_pend_queue"},
-	    {NULL, NULL}
-	};
-
-	if (nvlist_lookup_nvlist(nvroot,
-	    ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-		return (6);
-	}
+sample_pools_supervised(libzfs_handle_t *g_zfs, char *pool_name) {
+    collector_t *c;
+    uint64_t ts, now;
+    int ret = 0, err;
 
-	(void) printf("%s,name=%s,vdev=root ", VDEV_MEASUREMENT, pool_name);
-	for (int i = 0; queue_type[i].name; i++) {
-		if (nvlist_lookup_uint64(nv_ex,
-                                 queue_type[i].name, &value) != 0) {
-			fprintf(stderr, "error: can't get %s\n",
-			    queue_type[i].name);
-			return (3);
-		}
-		if (i > 0)
-			printf(",");
-		printf("%s="IFMT, queue_type[i].short_name, MASK_UINT64(value));
-	}
+    /* reap children that have exited since the last round */
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
 
-	(void) printf(" %lu\n", timestamp);
-	return (0);
+    ts = sample_time != 0 ? sample_time : clock_ns(CLOCK_REALTIME);
+    if (pool_name == NULL)
+        discover_pools(g_zfs);
+    else if (pool_wanted(pool_name, NULL))
+        (void) collector_get(pool_name);
+
+    for (c = collectors; c != NULL; c = c->next)
+        collector_request(c, g_zfs, sample_time);
+    collector_wait(collectors, clock_ns(CLOCK_MONOTONIC) + pool_timeout_ns);
+
+    now = clock_ns(CLOCK_MONOTONIC);
+    for (c = collectors; c != NULL; c = c->next) {
+        if (c->done) {
+            err = (int) c->hdr.err;
+            c->timeouts = 0;
+            c->reply.sink = output_writer.sink;
+            c->reply.sink_arg = output_writer.sink_arg;
+            if (lp_flush(&c->reply) != 0 && err == 0)
+                err = 7;
+            c->reply.sink = NULL;
+        } else if (c->pid == 0) {
+            err = COLLECTOR_EXITED;
+        } else {
+            err = COLLECTOR_TIMEOUT;
+            c->timeouts++;
+        }
+        if (ret == 0)
+            ret = err;
+
+        lp_measurement(&output_writer, COLLECTOR_HEALTH_MEASUREMENT);
+        lp_tag(&output_writer, "name", c->escaped_name);
+        lp_field_uint(&output_writer, "timed_out", c->timeouts != 0);
+        lp_field_uint(&output_writer, "consecutive_timeouts", c->timeouts);
+        lp_field_uint(&output_writer, "error",
+                      err == COLLECTOR_TIMEOUT ? 0 : (uint64_t) err);
+        lp_field_uint(&output_writer, "collect_time",
+                      c->done ? c->answered - c->sent :
+                      c->seq != 0 ? now - c->sent : 0);
+        lp_end(&output_writer, ts);
+    }
+    if (lp_flush(&output_writer) != 0 && ret == 0)
+        ret = 7;
+    return (ret);
 }
 
 /*
- * recursive stats printer
+ * --shm: the snapshot, laid out as in zpool_influxdb_shm.h, is written in
+ * place under its sequence lock. It only grows, into a new file that is
+ * renamed over the old one, which is then marked stale for the readers
+ * that still have it mapped.
  */
-typedef int (*stat_printer_f)(nvlist_t *, const char *, const char *);
+zpi_shm_header_t *shm_hdr = NULL;
+size_t shm_len = 0;
+
+void
+shm_seq_begin(zpi_shm_header_t *h) {
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+shm_seq_end(zpi_shm_header_t *h) {
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
 
 int
-print_recursive_stats(stat_printer_f func, nvlist_t *nvroot,
-                      const char *pool_name, const char *parent_name,
-                      int descend) {
-    uint_t c, children;
-    nvlist_t **child;
-    char vdev_name[256];
-    int err;
+shm_create(uint32_t nvdevs) {
+    zpi_shm_header_t *h;
+    char tmp[PATH_MAX];
+    uint32_t capacity = 64;
+    size_t len;
+    int fd;
 
-    err = func(nvroot, pool_name, parent_name);
-    if (err)
-        return (err);
+    while (capacity < nvdevs)
+        capacity *= 2;
+    len = sizeof (zpi_shm_header_t) + capacity * sizeof (zpi_shm_vdev_t);
+    /*
+     * next to it, so the rename can't cross file systems, and with a
+     * fresh name so a link planted in a shared /dev/shm isn't followed
+     */
+    (void) snprintf(tmp, sizeof (tmp), "%s.XXXXXX", shm_path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        fprintf(stderr, "error: cannot create %s: %s\n", tmp,
+                strerror(errno));
+        return (1);
+    }
+    /* readers run as other users, mkstemp() leaves it 0600 */
+    if (fchmod(fd, 0644) != 0 || ftruncate(fd, (off_t) len) != 0 ||
+        (h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0)) == MAP_FAILED) {
+        fprintf(stderr, "error: cannot map %s: %s\n", tmp, strerror(errno));
+        (void) close(fd);
+        (void) unlink(tmp);
+        return (1);
+    }
+    (void) close(fd);
+    h->magic = ZPI_SHM_MAGIC;
+    h->version = ZPI_SHM_VERSION;
+    h->header_size = sizeof (zpi_shm_header_t);
+    h->vdev_size = sizeof (zpi_shm_vdev_t);
+    h->capacity = capacity;
+    h->pid = (uint64_t) getpid();
+    if (shm_hdr != NULL)
+        h->samples = shm_hdr->samples;
+    if (rename(tmp, shm_path) != 0) {
+        fprintf(stderr, "error: cannot rename %s: %s\n", tmp,
+                strerror(errno));
+        (void) munmap(h, len);
+        (void) unlink(tmp);
+        return (1);
+    }
+
+    if (shm_hdr != NULL) {
+        shm_seq_begin(shm_hdr);
+        __atomic_store_n(&shm_hdr->stale, 1, __ATOMIC_RELAXED);
+        shm_seq_end(shm_hdr);
+        (void) munmap(shm_hdr, shm_len);
+    }
+    shm_hdr = h;
+    shm_len = len;
+    return (0);
+}
 
-    if (descend && nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
-                                              &child, &children) == 0) {
-        (void) strncpy(vdev_name, get_vdev_name(nvroot, parent_name),
-                       sizeof(vdev_name));
-        vdev_name[sizeof(vdev_name) - 1] = '\0';
+/*
+ * copy the vdevs kept for each pool into the snapshot
+ */
+int
+shm_publish(uint64_t ts) {
+    zpi_shm_vdev_t *slot;
+    pool_cache_t *pc;
+    uint32_t n = 0;
 
-        for (c = 0; c < children; c++) {
-            print_recursive_stats(func, child[c], pool_name,
-                                  vdev_name, descend);
-        }
+    for (pc = pool_caches; pc != NULL; pc = pc->next)
+        n += pc->shm_n;
+    if (n > shm_hdr->capacity && shm_create(n) != 0)
+        return (1);
+
+    shm_seq_begin(shm_hdr);
+    slot = (zpi_shm_vdev_t *) ((char *) shm_hdr + shm_hdr->header_size);
+    for (pc = pool_caches; pc != NULL; pc = pc->next) {
+        (void) memcpy(slot, pc->shm_vdevs, pc->shm_n * sizeof (*slot));
+        slot += pc->shm_n;
     }
+    shm_hdr->nvdevs = n;
+    shm_hdr->timestamp = ts;
+    shm_hdr->samples++;
+    shm_seq_end(shm_hdr);
     return (0);
 }
 
 /*
- * call-back to print the stats from the pool config
- *
- * Note: if the pool is broken, this can hang indefinitely and perhaps in an
- * unkillable state.
+ * sample all of the pools once
  */
 int
-print_stats(zpool_handle_t *zhp, void *data) {
-	uint_t c;
-	int err;
-	boolean_t missing;
-	nvlist_t *config, *nvroot;
-	vdev_stat_t *vs;
-	struct timespec tv;
-	char *pool_name;
+sample_pools(libzfs_handle_t *g_zfs, char *pool_name) {
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    pool_cache_t *pc;
+    int ret;
 
-	/* if not this pool return quickly */
-	if (data &&
-	    strncmp(data, zhp->zpool_name, ZFS_MAX_DATASET_NAME_LEN) != 0) {
-        zpool_close(zhp);
-        return (0);
+    if (pool_timeout_ns > 0)
+        ret = sample_pools_supervised(g_zfs, pool_name);
+    else if (nthreads > 0)
+        ret = sample_pools_parallel(g_zfs, pool_name);
+    else
+        ret = sample_pools_serial(g_zfs, pool_name);
+
+    /* a new --queue-sample window, even for a pool whose sample failed */
+    for (pc = pool_caches; pc != NULL; pc = pc->next)
+        pc->queue_rows = 0;
+    pool_cache_prune();
+    if (shm_path != NULL && shm_publish(sample_time != 0 ? sample_time :
+                                        clock_ns(CLOCK_REALTIME)) != 0 &&
+        ret == 0)
+        ret = 12;
+    if (arcstats) {
+        if (print_arcstats(&output_writer, sample_time != 0 ? sample_time :
+                           clock_ns(CLOCK_REALTIME)) != 0 && ret == 0)
+            ret = 11;
+        if (lp_flush(&output_writer) != 0 && ret == 0)
+            ret = 7;
     }
+    if (internal_stats) {
+        print_internal_stats(start);
+        if (lp_flush(&output_writer) != 0 && ret == 0)
+            ret = 7;
+    }
+    if (output_flush(0) != 0 && ret == 0)
+        ret = 7;
+    return (ret);
+}
 
-	if (zpool_refresh_stats(zhp, &missing) != 0) {
-        zpool_close(zhp);
+/*
+ * --events: a thread reads the ZFS event stream, as zed does, and flags the
+ * pool of each event that changes the vdev tree, a vdev's state or a scan.
+ * The flags tell pool_cache_get() to rebuild the vdev cache, so with
+ * --events the cache entries are trusted without checking them against
+ * the config, and the interval loop is woken through a pipe to print the
+ * pool's zpool_stats and zpool_scan_stats right away rather than at the
+ * next boundary. Only the main thread uses g_zfs, the thread has a libzfs
+ * handle of its own.
+ */
+const char *event_classes[] = {
+    "sysevent.fs.zfs.vdev_",        /* add, remove, attach, clear, ... */
+    "sysevent.fs.zfs.pool_",        /* import, destroy, reguid */
+    "sysevent.fs.zfs.config_sync",
+    "sysevent.fs.zfs.resilver_",    /* start, finish */
+    "sysevent.fs.zfs.scrub_",       /* start, finish, pause, resume */
+    "resource.fs.zfs.",             /* statechange, removed, ... */
+    "ereport.fs.zfs.vdev.",         /* open_failed, no_replicas, ... */
+    NULL
+};
+
+int event_fd = -1;
+int event_pipe[2] = { -1, -1 };
+
+/*
+ * flag a pool, or all of them if name is NULL, and wake the interval loop
+ */
+void
+event_mark(const char *name) {
+    pool_cache_t *pc;
+    char c = 0;
+
+    (void) pthread_mutex_lock(&pool_cache_lock);
+    for (pc = pool_caches; pc != NULL; pc = pc->next) {
+        if (name == NULL || strcmp(pc->name, name) == 0)
+            pc->event |= EVENT_REBUILD | EVENT_SAMPLE;
+    }
+    (void) pthread_mutex_unlock(&pool_cache_lock);
+    /* if the pipe is full, the loop is already due to wake up */
+    (void) write(event_pipe[1], &c, 1);
+}
+
+void *
+event_listener(void *arg) {
+    libzfs_handle_t *hdl = arg;
+    nvlist_t *nvl;
+    char *class, *pool;
+    int dropped, i;
+
+    while (zpool_events_next(hdl, &nvl, &dropped, ZEVENT_NONE,
+                             event_fd) == 0) {
+        /* the ones that were lost could have been anything */
+        if (dropped > 0)
+            event_mark(NULL);
+        if (nvl == NULL)
+            continue;
+        if (nvlist_lookup_string(nvl, "class", &class) == 0) {
+            for (i = 0; event_classes[i] != NULL; i++) {
+                if (strncmp(class, event_classes[i],
+                            strlen(event_classes[i])) == 0)
+                    break;
+            }
+            if (event_classes[i] != NULL) {
+                /* sysevents name the pool in pool_name, the rest in pool */
+                if (nvlist_lookup_string(nvl, "pool_name", &pool) != 0 &&
+                    nvlist_lookup_string(nvl, "pool", &pool) != 0)
+                    pool = NULL;
+                event_mark(pool);
+            }
+        }
+        nvlist_free(nvl);
+    }
+    /* back to checking the cache on every sample */
+    fprintf(stderr, "error: cannot read the ZFS events: %s\n",
+            strerror(errno));
+    pool_events = 0;
+    event_mark(NULL);
+    return (NULL);
+}
+
+int
+events_start(void) {
+    libzfs_handle_t *hdl;
+    pthread_t tid;
+
+    if ((event_fd = open(ZFS_DEV, O_RDWR)) < 0) {
+        fprintf(stderr, "error: cannot open %s: %s\n", ZFS_DEV,
+                strerror(errno));
+        return (1);
+    }
+    if ((hdl = libzfs_init()) == NULL) {
+        fprintf(stderr, "error: cannot initialize libzfs\n");
         return (1);
     }
+    /* only the events from now on */
+    if (zpool_events_seek(hdl, ZEVENT_SEEK_END, event_fd) != 0) {
+        fprintf(stderr, "error: cannot seek in the ZFS events\n");
+        return (1);
+    }
+    if (pipe(event_pipe) != 0 ||
+        fcntl(event_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(event_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "error: cannot create pipe: %s\n", strerror(errno));
+        return (1);
+    }
+    pool_events = 1;
+    if (pthread_create(&tid, NULL, event_listener, hdl) != 0) {
+        fprintf(stderr, "error: cannot start the event thread\n");
+        return (1);
+    }
+    (void) pthread_detach(tid);
+    return (0);
+}
 
-	config = zpool_get_config(zhp, NULL);
-	if (clock_gettime(CLOCK_REALTIME, &tv) != 0)
-		timestamp = (uint64_t) time(NULL) * 1000000000;
-	else
-		timestamp =
-		    ((uint64_t) tv.tv_sec * 1000000000) + (uint64_t) tv.tv_nsec;
+/*
+ * print the out-of-band samples of the pools flagged since the last time
+ */
+void
+sample_events(void) {
+    pool_cache_t *pc;
+    zpool_handle_t *zhp;
+    char **names = NULL;
+    char buf[64];
+    uint_t n = 0, size = 0;
 
-	if (nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &nvroot) != 0) {
-        zpool_close(zhp);
-		return (2);
-	}
-	if (nvlist_lookup_uint64_array(nvroot, ZPOOL_CONFIG_VDEV_STATS,
-	        (uint64_t **) &vs, &c) != 0) {
-        zpool_close(zhp);
-		return (3);
-	}
+    while (read(event_pipe[0], buf, sizeof (buf)) > 0)
+        continue;
+    (void) pthread_mutex_lock(&pool_cache_lock);
+    for (pc = pool_caches; pc != NULL; pc = pc->next) {
+        if ((pc->event & EVENT_SAMPLE) == 0)
+            continue;
+        pc->event &= ~EVENT_SAMPLE;
+        if (n == size) {
+            size = size ? size * 2 : 8;
+            names = safe_realloc(names, size * sizeof (char *));
+        }
+        names[n++] = safe_strdup(pc->name);
+    }
+    (void) pthread_mutex_unlock(&pool_cache_lock);
 
-	pool_name = escape_string(zhp->zpool_name);
-    err = print_recursive_stats(print_summary_stats, nvroot,
-            pool_name, NULL, 1);
-	/* if any of these return an error, skip the rest */
-	if (err == 0)
-        err = print_top_level_vdev_stats(nvroot, pool_name);
-
-	if (no_histograms == 0) {
-        if (err == 0)
-            err = print_recursive_stats(print_vdev_latency_stats, nvroot,
-                                        pool_name, NULL, 1);
-        if (err == 0)
-            err = print_recursive_stats(print_vdev_size_stats, nvroot,
-                                        pool_name, NULL, 1);
-        if (err == 0)
-            err = print_recursive_stats(print_queue_stats, nvroot,
-                                        pool_name, NULL, 0);
+    sample_time = clock_ns(CLOCK_REALTIME);
+    for (uint_t i = 0; i < n; i++) {
+        /* exported or destroyed */
+        if ((zhp = pool_handles_find(names[i])) != NULL) {
+            if (sample_pool(zhp, &output_writer, 1) == 9)
+                pool_handles.stale = 1;
+            (void) lp_flush(&output_writer);
+        }
+        free(names[i]);
     }
-    if (err == 0)
-        err = print_scan_status(nvroot, pool_name);
+    free(names);
+    /* the point is to be seen right away */
+    if (n > 0)
+        (void) output_flush(1);
+}
 
-    free(pool_name);
-    zpool_close(zhp);
-	return (err);
+/*
+ * sleep until deadline, a CLOCK_MONOTONIC time, unless there are events
+ */
+int
+wait_for_events(uint64_t deadline) {
+    struct pollfd pfd;
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    if (now >= deadline)
+        return (0);
+    pfd.fd = event_pipe[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000)) < 0) {
+        if (errno == EINTR)
+            return (0);
+        fprintf(stderr, "error: cannot poll: %s\n", strerror(errno));
+        return (1);
+    }
+    if (pfd.revents != 0)
+        sample_events();
+    return (0);
+}
+
+/*
+ * --queue-sample: add the root vdev's queue depths to each pool's window.
+ * A pool that can't be refreshed is left for the interval's sample to
+ * notice, as are the changes to its config and the events' rebuilds,
+ * which pool_cache_get() would act on and consume.
+ */
+void
+sample_queues(void) {
+    zpool_handle_t *zhp;
+    nvlist_t *config, *nvroot;
+
+    for (uint_t i = 0; i < pool_handles.n; i++) {
+        zhp = pool_handles.zhp[i];
+        if ((config = pool_refresh(zhp)) == NULL)
+            continue;
+        if (nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE,
+                                 &nvroot) != 0)
+            continue;
+        (void) queue_window_add(pool_cache_find(zhp->zpool_name), nvroot);
+    }
+}
+
+/*
+ * sleep until deadline, a CLOCK_MONOTONIC time, or until there are events,
+ * taking the --queue-sample samples that fall due on the way
+ */
+int
+interval_sleep(uint64_t deadline) {
+    static uint64_t queue_next = 0;
+    uint64_t now, until;
+    struct timespec ts;
+    int ret;
+
+    for (;;) {
+        until = deadline;
+        if (queue_sample_ns != 0) {
+            now = clock_ns(CLOCK_MONOTONIC);
+            if (queue_next <= now) {
+                if (queue_next != 0)
+                    sample_queues();
+                /* the ones that were missed are skipped */
+                queue_next += queue_sample_ns;
+                if (queue_next <= now)
+                    queue_next = now + queue_sample_ns;
+            }
+            if (queue_next < until)
+                until = queue_next;
+        }
+        if (event_fd >= 0) {
+            /* which returns early to print an event's sample */
+            if (wait_for_events(until) != 0)
+                return (1);
+        } else {
+            ts.tv_sec = (time_t) (until / 1000000000);
+            ts.tv_nsec = (long) (until % 1000000000);
+            while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                          &ts, NULL)) == EINTR) {
+                continue;
+            }
+            if (ret != 0) {
+                fprintf(stderr, "error: cannot sleep: %s\n", strerror(ret));
+                return (1);
+            }
+        }
+        if (until == deadline)
+            return (0);
+    }
 }
 
+/*
+ * --interval mode: sample on wall-clock boundaries that are a multiple of
+ * the interval, for example :00, :10, :20 for a 10 second interval. All
+ * pools in a sample get the boundary as their timestamp, so samples line
+ * up across hosts and with GROUP BY time() buckets.
+ *
+ * The sleep itself is against CLOCK_MONOTONIC so it isn't disturbed by the
+ * wall clock being stepped. The wall clock is re-read for each interval,
+ * which corrects any drift between the two. If a sample overruns one or
+ * more boundaries, those intervals are skipped rather than sampled late.
+ */
+int
+run_interval(libzfs_handle_t *g_zfs, char *pool_name) {
+    uint64_t now, next, deadline;
+
+    for (;;) {
+        now = clock_ns(CLOCK_REALTIME);
+        next = (now / interval_ns + 1) * interval_ns;
+        /* in case the wall clock was stepped back while we slept */
+        while (now < next) {
+            deadline = clock_ns(CLOCK_MONOTONIC) + (next - now);
+            if (interval_sleep(deadline) != 0)
+                return (1);
+            now = clock_ns(CLOCK_REALTIME);
+            /* a stepped-forward clock can't be made up, sample now */
+            if (now >= next || next - now < 1000000)
+                break;
+        }
+        sample_time = next;
+        (void) sample_pools(g_zfs, pool_name);
+    }
+    return (0);
+}
 
 void
 usage(char* name) {
     fprintf(stderr, "usage: %s [--execd][--no-histograms]"
-                    "[--sum-histogram-buckets] [poolname]\n", name);
+                    "[--sum-histogram-buckets][--batch-size bytes]"
+                    "[--interval seconds][--threads count]"
+                    "[--pool-timeout seconds][--output url][--flush-interval seconds]"
+                    "[--gzip][--listen [addr:]port][--latency-summary]"
+                    "[--no-latency-buckets][--rates][--histogram-deltas]"
+                    "[--latency-range min:max][--size-range min:max]"
+                    "[--bucket-factor n][--max-depth depth]"
+                    "[--top-leaves n[:ops|:latency]][--internal-stats]"
+                    "[--arcstats][--txgs][--datasets][--record file]"
+                    "[--replay file][--paced][--events]"
+                    "[--include glob[,glob]][--exclude glob[,glob]]"
+                    "[--select measurement[:field[,field]]]"
+                    "[--fields-file file][--queue-sample hz][--shm file]"
+                    "[--guid-tags][--classes][--ioctl]"
+                    " [poolname]\n", name);
     exit(EXIT_FAILURE);
 }
 
@@ -789,30 +6445,334 @@ main(int argc, char *argv[]) {
     int opt;
     int ret = 8;
     char *line = NULL;
+    char *end;
     size_t len = 0;
+    double secs;
+    char *listen_addr = NULL;
+    char *record_path = NULL, *replay_path = NULL;
+    long value;
+    int events = 0;
     struct option long_options[] = {
+        {"arcstats", no_argument, NULL, 'a'},
+        {"batch-size", required_argument, NULL, 'b'},
+        {"bucket-factor", required_argument, NULL, 'F'},
+        {"classes", no_argument, NULL, 'C'},
+        {"datasets", no_argument, NULL, 'O'},
+        {"events", no_argument, NULL, 'E'},
+        {"exclude", required_argument, NULL, 'G'},
         {"execd", no_argument, NULL, 'e'},
+        {"fields-file", required_argument, NULL, 'K'},
+        {"flush-interval", required_argument, NULL, 'f'},
+        {"guid-tags", no_argument, NULL, 'u'},
+        {"gzip", no_argument, NULL, 'z'},
         {"help", no_argument, NULL, 'h'},
+        {"histogram-deltas", no_argument, NULL, 'd'},
+        {"include", required_argument, NULL, 'g'},
+        {"internal-stats", no_argument, NULL, 'I'},
+        {"interval", required_argument, NULL, 'i'},
+        {"ioctl", no_argument, NULL, 'X'},
+        {"latency-range", required_argument, NULL, 'R'},
+        {"latency-summary", no_argument, NULL, 'L'},
+        {"listen", required_argument, NULL, 'l'},
+        {"max-depth", required_argument, NULL, 'D'},
         {"no-histograms", no_argument, NULL, 'n'},
+        {"no-latency-buckets", no_argument, NULL, 'B'},
+        {"output", required_argument, NULL, 'o'},
+        {"paced", no_argument, NULL, 'P'},
+        {"pool-timeout", required_argument, NULL, 'p'},
+        {"queue-sample", required_argument, NULL, 'Q'},
+        {"rates", no_argument, NULL, 'r'},
+        {"record", required_argument, NULL, 'w'},
+        {"replay", required_argument, NULL, 'W'},
+        {"select", required_argument, NULL, 'k'},
+        {"shm", required_argument, NULL, 'm'},
+        {"size-range", required_argument, NULL, 'S'},
         {"sum-histogram-buckets", no_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 't'},
+        {"top-leaves", required_argument, NULL, 'T'},
+        {"txgs", no_argument, NULL, 'x'},
         {0, 0, 0, 0}
     };
-    while ((opt = getopt_long(argc, argv, "ehns", long_options, NULL)) != -1) {
+
+    while ((opt = getopt_long(argc, argv, "ab:BCD:dEeF:f:G:g:hIi:K:k:l:Lm:nOo:Pp:Q:R:rS:sT:t:uW:w:Xxz", long_options,
+                              NULL)) != -1) {
         switch (opt) {
+            case 'a':
+                arcstats = 1;
+                break;
+            case 'b':
+                errno = 0;
+                batch_size = strtoull(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0')
+                    usage(argv[0]);
+                break;
+            case 'B':
+                no_latency_buckets = 1;
+                break;
+            case 'C':
+                class_stats = 1;
+                break;
+            case 'D':
+                errno = 0;
+                max_depth = (int) strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    max_depth < 0 || max_depth > 64)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                histogram_deltas = 1;
+                break;
+            case 'E':
+                events = 1;
+                break;
             case 'e':
                 execd_mode = 1;
                 break;
+            case 'F':
+                errno = 0;
+                value = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    value < 2 || value > (1L << 30) ||
+                    (value & (value - 1)) != 0)
+                    usage(argv[0]);
+                for (lat_range.step = 0; value > 1; value >>= 1)
+                    lat_range.step++;
+                size_range.step = lat_range.step;
+                break;
+            case 'f':
+                errno = 0;
+                secs = strtod(optarg, &end);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    secs < 0 || secs > 86400)
+                    usage(argv[0]);
+                flush_interval_ns = (uint64_t) (secs * 1e9 + 0.5);
+                break;
+            case 'G':
+                glob_list_add(&pool_exclude, optarg);
+                break;
+            case 'g':
+                glob_list_add(&pool_include, optarg);
+                break;
+            case 'I':
+                internal_stats = 1;
+                break;
+            case 'K':
+                if (select_file(optarg) != 0)
+                    exit(EXIT_FAILURE);
+                break;
+            case 'k':
+                if (select_parse(optarg) != 0)
+                    exit(EXIT_FAILURE);
+                break;
+            case 'i':
+                errno = 0;
+                secs = strtod(optarg, &end);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    secs < 0.001 || secs > 86400)
+                    usage(argv[0]);
+                interval_ns = (uint64_t) (secs * 1e9 + 0.5);
+                break;
+            case 'L':
+                latency_summary = 1;
+                break;
+            case 'l':
+                if (net_out.proto != OUTPUT_STDOUT)
+                    usage(argv[0]);
+                net_out.proto = OUTPUT_PROM;
+                listen_addr = optarg;
+                break;
+            case 'm':
+                shm_path = optarg;
+                break;
             case 'n':
                 no_histograms = 1;
                 break;
+            case 'O':
+                dataset_stats = 1;
+                break;
+            case 'o':
+                if (net_out.proto != OUTPUT_STDOUT)
+                    usage(argv[0]);
+                if (output_parse(&net_out, optarg) != 0)
+                    exit(EXIT_FAILURE);
+                break;
+            case 'P':
+                replay_paced = 1;
+                break;
+            case 'p':
+                errno = 0;
+                secs = strtod(optarg, &end);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    secs < 0.001 || secs > 86400)
+                    usage(argv[0]);
+                pool_timeout_ns = (uint64_t) (secs * 1e9 + 0.5);
+                break;
+            case 'Q':
+                errno = 0;
+                secs = strtod(optarg, &end);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    secs < 0.1 || secs > 1000)
+                    usage(argv[0]);
+                queue_sample_ns = (uint64_t) (1e9 / secs + 0.5);
+                break;
+            case 'R':
+                if (histo_range_parse(optarg, lat_units, &lat_range) != 0)
+                    exit(EXIT_FAILURE);
+                break;
+            case 'r':
+                print_rates = 1;
+                break;
+            case 'S':
+                if (histo_range_parse(optarg, size_units, &size_range) != 0)
+                    exit(EXIT_FAILURE);
+                break;
             case 's':
                 sum_histogram_buckets = 1;
                 break;
+            case 'T':
+                errno = 0;
+                value = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || value < 1 ||
+                    value > 1000000)
+                    usage(argv[0]);
+                top_leaves = (uint_t) value;
+                if (strcmp(end, ":latency") == 0)
+                    top_leaves_by = TOP_BY_LATENCY;
+                else if (*end != '\0' && strcmp(end, ":ops") != 0)
+                    usage(argv[0]);
+                break;
+            case 't':
+                errno = 0;
+                nthreads = (int) strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' ||
+                    nthreads < 0 || nthreads > 256)
+                    usage(argv[0]);
+                break;
+            case 'u':
+                guid_tags = 1;
+                break;
+            case 'W':
+                replay_path = optarg;
+                break;
+            case 'w':
+                record_path = optarg;
+                break;
+            case 'X':
+#ifdef HAVE_ZFS_IOCTL_H
+                zfs_ioctl = 1;
+                break;
+#else
+                fprintf(stderr, "error: --ioctl needs zpool_influxdb to be "
+                                "built with sys/zfs_ioctl.h\n");
+                exit(EXIT_FAILURE);
+#endif
+            case 'x':
+                txg_history = 1;
+                break;
+            case 'z':
+#ifdef HAVE_ZLIB
+                net_out.gzip = 1;
+                break;
+#else
+                fprintf(stderr, "error: --gzip needs zpool_influxdb to be "
+                                "built with zlib\n");
+                exit(EXIT_FAILURE);
+#endif
             default:
                 usage(argv[0]);
         }
     }
 
+	if (execd_mode && interval_ns != 0)
+		usage(argv[0]);
+	if (pool_timeout_ns != 0 && nthreads != 0)
+		usage(argv[0]);
+	if ((net_out.gzip || flush_interval_ns != 0) &&
+	    net_out.proto != OUTPUT_HTTP && net_out.proto != OUTPUT_OTLP)
+		usage(argv[0]);
+	/* the buckets of an exponential histogram, one by one */
+	if (net_out.proto == OUTPUT_OTLP) {
+		if (lat_range.step != 1)
+			usage(argv[0]);
+		sum_histogram_buckets = 0;
+	}
+	/* a replay is printed once, as fast as it's read or --paced */
+	if (replay_path != NULL &&
+	    (execd_mode || interval_ns != 0 || nthreads != 0 ||
+	     pool_timeout_ns != 0 || net_out.proto == OUTPUT_PROM ||
+	     record_path != NULL || arcstats || txg_history ||
+	     dataset_stats))
+		usage(argv[0]);
+	if (replay_paced && replay_path == NULL)
+		usage(argv[0]);
+	/*
+	 * the event samples are printed between the interval's, by the main
+	 * process, and would be lost in a scrape
+	 */
+	if (events && (interval_ns == 0 || pool_timeout_ns != 0 ||
+	    net_out.proto == OUTPUT_PROM || replay_path != NULL))
+		usage(argv[0]);
+	/* the vdevs are kept in the pool caches, which are the collectors' */
+	if (shm_path != NULL && pool_timeout_ns != 0)
+		usage(argv[0]);
+	/* the pools are sampled by the main process, between the intervals */
+	if (queue_sample_ns != 0 && (interval_ns == 0 || pool_timeout_ns != 0))
+		usage(argv[0]);
+	/*
+	 * scrapes are served from the samples taken on the interval, and
+	 * histogram_quantile() wants the buckets cumulative
+	 */
+	if (net_out.proto == OUTPUT_PROM) {
+		if (interval_ns == 0 || histogram_deltas)
+			usage(argv[0]);
+		sum_histogram_buckets = 1;
+	}
+	/* --select picks zpool_rates and the latency measurements itself */
+	if (select_given && (print_rates || latency_summary ||
+	    no_latency_buckets))
+		usage(argv[0]);
+
+	select_compile();
+	stats_ex_init();
+	init_histogram_tags();
+	if (net_out.proto == OUTPUT_HTTP)
+		lp_init(&output_writer, lp_sink_http, &net_out);
+	else if (net_out.proto == OUTPUT_UDP)
+		lp_init(&output_writer, lp_sink_udp, &net_out);
+	else if (net_out.proto == OUTPUT_PROM)
+		lp_init(&output_writer, lp_sink_prom, NULL);
+	else if (net_out.proto == OUTPUT_OTLP)
+		lp_init(&output_writer, lp_sink_otlp, NULL);
+	else
+		lp_init(&output_writer, lp_sink_fd, &stdout_fd);
+	output_writer.batch_max = batch_size;
+	if (net_out.proto == OUTPUT_OTLP)
+		otlp_start();
+
+	/* no need for ZFS */
+	if (replay_path != NULL) {
+		ret = replay(replay_path, argv[optind]);
+		if (output_flush(1) != 0 && ret == 0)
+			ret = 7;
+		return (ret);
+	}
+	if (record_path != NULL && record_open(record_path) != 0)
+		exit(EXIT_FAILURE);
+	if (arcstats && kstat_open(&arc_kstat) != 0)
+		exit(EXIT_FAILURE);
+	if (shm_path != NULL && shm_create(0) != 0)
+		exit(EXIT_FAILURE);
+#ifdef HAVE_ZFS_IOCTL_H
+	if (zfs_ioctl &&
+	    (zfs_ioctl_fd = open(ZFS_DEV, O_RDWR | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "error: cannot open %s: %s\n", ZFS_DEV,
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+#endif
+	if (dataset_stats)
+		raise_fd_limit();
+
 	libzfs_handle_t *g_zfs;
 	if ((g_zfs = libzfs_init()) == NULL) {
 		fprintf(stderr,
@@ -820,14 +6780,28 @@ main(int argc, char *argv[]) {
 		    "Is the zfs module loaded or zrepl running?");
 		exit(EXIT_FAILURE);
 	}
+	if (listen_addr != NULL && prom_start(listen_addr) != 0)
+		exit(EXIT_FAILURE);
+	if (events && events_start() != 0)
+		exit(EXIT_FAILURE);
+	if (nthreads > 0)
+		start_workers();
+	/* a collector that has gone away is noticed when it's read */
+	if (pool_timeout_ns != 0)
+		(void) signal(SIGPIPE, SIG_IGN);
+	if (interval_ns != 0)
+		return (run_interval(g_zfs, argv[optind]));
 	if (execd_mode == 0) {
-        ret = zpool_iter(g_zfs, print_stats, argv[optind]);
+        ret = sample_pools(g_zfs, argv[optind]);
+        if (output_flush(1) != 0 && ret == 0)
+            ret = 7;
         return (ret);
     }
     while (getline(&line, &len, stdin) != -1) {
-        ret = zpool_iter(g_zfs, print_stats, argv[optind]);
-        fflush(stdout);
+        ret = sample_pools(g_zfs, argv[optind]);
 	}
+    if (output_flush(1) != 0 && ret == 0)
+        ret = 7;
     return (ret);
 }
 
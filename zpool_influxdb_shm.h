@@ -0,0 +1,125 @@
+/*
+ * The layout of the --shm snapshot
+ *
+ * With --shm path, zpool_influxdb keeps the stats of the vdevs it printed
+ * in its last sample in a file, usually under /dev/shm, that other local
+ * processes can mmap() read-only and copy consistent snapshots from
+ * without locks and without libzfs. The file is a zpi_shm_header_t
+ * followed by capacity zpi_shm_vdev_t slots, of which the first nvdevs
+ * are the snapshot, pool by pool and in the order of the vdev tree.
+ *
+ * The snapshot is guarded by a sequence lock: seq is odd while it is
+ * being updated, and changes with every update. A reader reads seq,
+ * copies what it needs, and reads seq again; if seq was odd or has
+ * changed, the copy is torn and has to be taken again.
+ * zpi_shm_snapshot() below does that.
+ *
+ * When more vdevs turn up than there are slots, a larger file is put in
+ * place of the old one, and the old one is marked stale. A reader that
+ * sees stale has to open the path again.
+ *
+ * The fields only ever get added at the end of the structures, with a
+ * new version. Check magic and version, and use header_size and
+ * vdev_size to step through the file rather than sizeof.
+ *
+ * This file is under the same MIT license as zpool_influxdb.c.
+ */
+
+#ifndef ZPOOL_INFLUXDB_SHM_H
+#define ZPOOL_INFLUXDB_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define ZPI_SHM_MAGIC       0x315f6d687369707aULL  /* "zpishm_1" */
+#define ZPI_SHM_VERSION     1
+#define ZPI_SHM_NAME_LEN    256
+
+/* the queues, in the order of zpool_vdev_queue */
+#define ZPI_SHM_QUEUE_SYNC_READ     0
+#define ZPI_SHM_QUEUE_SYNC_WRITE    1
+#define ZPI_SHM_QUEUE_ASYNC_READ    2
+#define ZPI_SHM_QUEUE_ASYNC_WRITE   3
+#define ZPI_SHM_QUEUE_SCRUB         4
+#define ZPI_SHM_QUEUES              5
+
+typedef struct zpi_shm_header {
+    uint64_t magic;             /* ZPI_SHM_MAGIC */
+    uint32_t version;           /* ZPI_SHM_VERSION */
+    uint32_t header_size;       /* where the first slot starts */
+    uint32_t vdev_size;         /* of each slot */
+    uint32_t capacity;          /* slots in the file */
+    uint64_t seq;               /* odd while being updated */
+    uint64_t timestamp;         /* of the sample, ns since the epoch */
+    uint64_t samples;           /* published since zpool_influxdb started */
+    uint32_t nvdevs;            /* slots in this snapshot */
+    uint32_t stale;             /* replaced, open the path again */
+    uint64_t pid;               /* of the zpool_influxdb writing it */
+    uint64_t reserved[7];
+} zpi_shm_header_t;
+
+typedef struct zpi_shm_vdev {
+    char pool[ZPI_SHM_NAME_LEN];    /* pool name */
+    char vdev[ZPI_SHM_NAME_LEN];    /* as the vdev tag, root/mirror-0/... */
+    char path[ZPI_SHM_NAME_LEN];    /* device path for leaves, or "" */
+    uint64_t timestamp;         /* of the pool's sample, ns since the epoch */
+    uint64_t guid;              /* 0 if the vdev has none */
+    uint32_t depth;             /* 0 is the root, 1 a top-level vdev */
+    uint32_t state;             /* vdev_state_t */
+    uint32_t aux;               /* vdev_aux_t */
+    uint32_t has_queues;        /* the queue depths below are valid */
+    uint64_t alloc;             /* bytes */
+    uint64_t size;              /* bytes */
+    uint64_t read_ops;
+    uint64_t write_ops;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t read_errors;
+    uint64_t write_errors;
+    uint64_t checksum_errors;
+    uint64_t fragmentation;     /* percent */
+    uint64_t active_queue[ZPI_SHM_QUEUES];
+    uint64_t pend_queue[ZPI_SHM_QUEUES];
+} zpi_shm_vdev_t;
+
+#define ZPI_SHM_OK          0
+#define ZPI_SHM_BUSY        1   /* still being updated, try again later */
+#define ZPI_SHM_STALE       2   /* open the path again */
+#define ZPI_SHM_INVALID     3   /* not a snapshot, or an unknown version */
+
+/*
+ * copy a consistent snapshot of up to max vdevs from the mapped file at h
+ * into vdevs, setting *nvdevs to the number in the snapshot, which can be
+ * more than max
+ */
+static inline int
+zpi_shm_snapshot(const zpi_shm_header_t *h, zpi_shm_vdev_t *vdevs,
+                 uint32_t max, uint32_t *nvdevs, uint64_t *timestamp) {
+    const char *slots = (const char *) h + h->header_size;
+    uint64_t seq;
+    uint32_t n;
+
+    if (h->magic != ZPI_SHM_MAGIC || h->version < ZPI_SHM_VERSION ||
+        h->vdev_size < sizeof (zpi_shm_vdev_t))
+        return (ZPI_SHM_INVALID);
+    for (int tries = 0; tries < 1000; tries++) {
+        seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->stale, __ATOMIC_ACQUIRE))
+            return (ZPI_SHM_STALE);
+        if (seq & 1)
+            continue;
+        n = h->nvdevs;
+        *timestamp = h->timestamp;
+        for (uint32_t i = 0; i < n && i < max && i < h->capacity; i++)
+            (void) memcpy(&vdevs[i], slots + (size_t) i * h->vdev_size,
+                          sizeof (zpi_shm_vdev_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) {
+            *nvdevs = n;
+            return (ZPI_SHM_OK);
+        }
+    }
+    return (ZPI_SHM_BUSY);
+}
+
+#endif  /* ZPOOL_INFLUXDB_SHM_H */